@@ -0,0 +1,194 @@
+#include "AVLTree.h"
+#include "Types.h"
+
+#include <algorithm>
+
+COUNT_LIVE(AVLNode);
+
+static int heightOf(const AVLNodePtr& node)
+{
+    return node ? node->height() : 0;
+}
+
+AVLNode::AVLNode(malValuePtr key, malValuePtr value,
+                 AVLNodePtr left, AVLNodePtr right)
+: m_key(key)
+, m_value(value)
+, m_left(left)
+, m_right(right)
+, m_height(1 + std::max(heightOf(left), heightOf(right)))
+{
+
+}
+
+void AVLNode::getChildren(RefCountedVec& children) const
+{
+    children.push_back(m_key.ptr());
+    children.push_back(m_value.ptr());
+    children.push_back(m_left.ptr());
+    children.push_back(m_right.ptr());
+}
+
+static AVLNodePtr makeNode(malValuePtr key, malValuePtr value,
+                           AVLNodePtr left, AVLNodePtr right)
+{
+    return AVLNodePtr(new AVLNode(key, value, left, right));
+}
+
+// Builds a node from subtrees whose heights differ by at most two,
+// rotating as necessary so that they differ by at most one.
+static AVLNodePtr balance(malValuePtr key, malValuePtr value,
+                          AVLNodePtr left, AVLNodePtr right)
+{
+    int leftHeight = heightOf(left), rightHeight = heightOf(right);
+    if (leftHeight > rightHeight + 1) {
+        if (heightOf(left->left()) >= heightOf(left->right())) {
+            return makeNode(left->key(), left->value(), left->left(),
+                            makeNode(key, value, left->right(), right));
+        }
+        const AVLNodePtr& pivot = left->right();
+        return makeNode(pivot->key(), pivot->value(),
+            makeNode(left->key(), left->value(), left->left(), pivot->left()),
+            makeNode(key, value, pivot->right(), right));
+    }
+    if (rightHeight > leftHeight + 1) {
+        if (heightOf(right->right()) >= heightOf(right->left())) {
+            return makeNode(right->key(), right->value(),
+                            makeNode(key, value, left, right->left()),
+                            right->right());
+        }
+        const AVLNodePtr& pivot = right->left();
+        return makeNode(pivot->key(), pivot->value(),
+            makeNode(key, value, left, pivot->left()),
+            makeNode(right->key(), right->value(), pivot->right(),
+                     right->right()));
+    }
+    return makeNode(key, value, left, right);
+}
+
+static AVLNodePtr insert(const AVLNodePtr& node, malValuePtr key,
+                         malValuePtr value, bool& added)
+{
+    if (!node) {
+        added = true;
+        return makeNode(key, value, NULL, NULL);
+    }
+
+    int order = compareValues(key, node->key());
+    if (order < 0) {
+        AVLNodePtr left = insert(node->left(), key, value, added);
+        return left == node->left() ? node
+            : balance(node->key(), node->value(), left, node->right());
+    }
+    if (order > 0) {
+        AVLNodePtr right = insert(node->right(), key, value, added);
+        return right == node->right() ? node
+            : balance(node->key(), node->value(), node->left(), right);
+    }
+    return node->value() == value ? node
+        : makeNode(node->key(), value, node->left(), node->right());
+}
+
+static AVLNodePtr removeFirst(const AVLNodePtr& node)
+{
+    if (!node->left()) {
+        return node->right();
+    }
+    return balance(node->key(), node->value(),
+                   removeFirst(node->left()), node->right());
+}
+
+static AVLNodePtr remove(const AVLNodePtr& node, malValuePtr key,
+                         bool& removed)
+{
+    if (!node) {
+        return node;
+    }
+
+    int order = compareValues(key, node->key());
+    if (order < 0) {
+        AVLNodePtr left = remove(node->left(), key, removed);
+        return !removed ? node
+            : balance(node->key(), node->value(), left, node->right());
+    }
+    if (order > 0) {
+        AVLNodePtr right = remove(node->right(), key, removed);
+        return !removed ? node
+            : balance(node->key(), node->value(), node->left(), right);
+    }
+
+    removed = true;
+    if (!node->left()) {
+        return node->right();
+    }
+    if (!node->right()) {
+        return node->left();
+    }
+    // Replace the node with its successor.
+    const AVLNode* next = node->right().ptr();
+    while (next->left()) {
+        next = next->left().ptr();
+    }
+    return balance(next->key(), next->value(),
+                   node->left(), removeFirst(node->right()));
+}
+
+AVLTree::AVLTree()
+: m_count(0)
+{
+
+}
+
+const malValueRef* AVLTree::find(malValuePtr key) const
+{
+    const AVLNode* node = m_root.ptr();
+    while (node != NULL) {
+        int order = compareValues(key, node->key());
+        if (order == 0) {
+            return &node->value();
+        }
+        node = (order < 0) ? node->left().ptr() : node->right().ptr();
+    }
+    return NULL;
+}
+
+AVLTree AVLTree::assoc(malValuePtr key, malValuePtr value) const
+{
+    bool added = false;
+    AVLNodePtr root = insert(m_root, key, value, added);
+    return AVLTree(root, m_count + (added ? 1 : 0));
+}
+
+AVLTree AVLTree::dissoc(malValuePtr key) const
+{
+    bool removed = false;
+    AVLNodePtr root = remove(m_root, key, removed);
+    return removed ? AVLTree(root, m_count - 1) : *this;
+}
+
+AVLTree::Iterator AVLTree::begin(bool ascending) const
+{
+    Iterator it(ascending);
+    it.descend(m_root.ptr());
+    return it;
+}
+
+AVLTree::Iterator AVLTree::from(malValuePtr key, bool inclusive,
+                                bool ascending) const
+{
+    // Keep the nodes on the search path which are in range; the last one
+    // kept is the nearest to key, the others follow it in order.
+    Iterator it(ascending);
+    const AVLNode* node = m_root.ptr();
+    while (node != NULL) {
+        int order = compareValues(node->key(), key);
+        bool inRange = ascending ? (order > 0 || (inclusive && order == 0))
+                                 : (order < 0 || (inclusive && order == 0));
+        if (inRange) {
+            it.m_path.push_back(node);
+        }
+        node = (inRange == ascending) ? node->left().ptr()
+                                      : node->right().ptr();
+    }
+    return it;
+}
@@ -0,0 +1,117 @@
+#ifndef INCLUDE_AVLTREE_H
+#define INCLUDE_AVLTREE_H
+
+#include "MAL.h"
+
+//  A persistent AVL tree of key/value pairs, ordered by compareValues.
+//
+//  Updates copy the O(log n) nodes on the path to the key, rebalancing them
+//  on the way back up, and share every other subtree with the original.
+//  Iterators walk the tree in either direction from any starting key, so a
+//  range of k entries is visited in O(log n + k).
+//
+//  AVLTree is a small value type; copying it shares the whole tree.
+
+class AVLNode;
+typedef RefCountedPtr<AVLNode> AVLNodePtr;
+
+class AVLNode : public Counted<AVLNode, RefCounted> {
+public:
+    AVLNode(malValuePtr key, malValuePtr value,
+            AVLNodePtr left, AVLNodePtr right);
+
+    const malValueRef& key() const { return m_key; }
+    const malValueRef& value() const { return m_value; }
+    const AVLNodePtr& left() const { return m_left; }
+    const AVLNodePtr& right() const { return m_right; }
+    int height() const { return m_height; }
+
+    virtual void getChildren(RefCountedVec& children) const;
+
+private:
+    const malValueRef m_key;
+    const malValueRef m_value;
+    const AVLNodePtr  m_left;
+    const AVLNodePtr  m_right;
+    const int         m_height;
+};
+
+class AVLTree {
+public:
+    class Iterator;
+
+    AVLTree();
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+
+    // Returns NULL if the key isn't present.
+    const malValueRef* find(malValuePtr key) const;
+
+    AVLTree assoc(malValuePtr key, malValuePtr value) const;
+    AVLTree dissoc(malValuePtr key) const;
+
+    // Ascending from the first entry, or descending from the last.
+    Iterator begin(bool ascending = true) const;
+    Iterator end() const;
+
+    // Ascending from the first entry after key, or descending from the last
+    // entry before it. The entry at key itself is included if inclusive.
+    Iterator from(malValuePtr key, bool inclusive, bool ascending) const;
+
+    void getChildren(RefCountedVec& children) const {
+        children.push_back(m_root.ptr());
+    }
+
+private:
+    AVLTree(AVLNodePtr root, int count) : m_root(root), m_count(count) { }
+
+    AVLNodePtr m_root;
+    int        m_count;
+};
+
+class AVLTree::Iterator {
+public:
+    Iterator(bool ascending) : m_ascending(ascending) { }
+
+    const AVLNode& operator * () const { return *m_path.back(); }
+    const AVLNode* operator -> () const { return m_path.back(); }
+
+    Iterator& operator ++ () {
+        const AVLNode* node = m_path.back();
+        m_path.pop_back();
+        descend(m_ascending ? node->right().ptr() : node->left().ptr());
+        return *this;
+    }
+
+    bool operator == (const Iterator& that) const {
+        return m_path.empty() ? that.m_path.empty()
+            : !that.m_path.empty() && m_path.back() == that.m_path.back();
+    }
+
+    bool operator != (const Iterator& that) const {
+        return !(*this == that);
+    }
+
+private:
+    friend class AVLTree;
+
+    // Pushes node and its chain of nearest-first descendants.
+    void descend(const AVLNode* node) {
+        for ( ; node != NULL;
+                node = m_ascending ? node->left().ptr() : node->right().ptr()) {
+            m_path.push_back(node);
+        }
+    }
+
+    // The nodes still to be visited on the way back up, nearest last.
+    std::vector<const AVLNode*> m_path;
+    bool                        m_ascending;
+};
+
+inline AVLTree::Iterator AVLTree::end() const
+{
+    return Iterator(true);
+}
+
+#endif // INCLUDE_AVLTREE_H
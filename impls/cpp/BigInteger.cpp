@@ -0,0 +1,410 @@
+#include "BigInteger.h"
+#include "Validation.h"
+
+#include <algorithm>
+
+typedef std::vector<uint32_t> Limbs;
+
+// Below this many limbs Karatsuba's extra additions cost more than the
+// multiplications they save.
+static const size_t KARATSUBA_THRESHOLD = 32;
+
+static void trim(Limbs& limbs)
+{
+    while (!limbs.empty() && limbs.back() == 0) {
+        limbs.pop_back();
+    }
+}
+
+static int compareMagnitude(const Limbs& a, const Limbs& b)
+{
+    if (a.size() != b.size()) {
+        return a.size() < b.size() ? -1 : 1;
+    }
+    for (size_t i = a.size(); i-- > 0; ) {
+        if (a[i] != b[i]) {
+            return a[i] < b[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+// Adds b, shifted up by shift limbs, into a.
+static void addInto(Limbs& a, const Limbs& b, size_t shift = 0)
+{
+    if (a.size() < b.size() + shift) {
+        a.resize(b.size() + shift, 0);
+    }
+    uint64_t carry = 0;
+    size_t i = 0;
+    for ( ; i < b.size(); i++) {
+        uint64_t sum = uint64_t(a[i + shift]) + b[i] + carry;
+        a[i + shift] = static_cast<uint32_t>(sum);
+        carry = sum >> 32;
+    }
+    for (i += shift; carry != 0; i++) {
+        if (i == a.size()) {
+            a.push_back(0);
+        }
+        uint64_t sum = uint64_t(a[i]) + carry;
+        a[i] = static_cast<uint32_t>(sum);
+        carry = sum >> 32;
+    }
+}
+
+// Subtracts b from a, which must be at least as large.
+static void subtractFrom(Limbs& a, const Limbs& b)
+{
+    int64_t borrow = 0;
+    size_t i = 0;
+    for ( ; i < b.size(); i++) {
+        int64_t diff = int64_t(a[i]) - b[i] - borrow;
+        a[i] = static_cast<uint32_t>(diff);
+        borrow = diff < 0 ? 1 : 0;
+    }
+    for ( ; borrow != 0; i++) {
+        int64_t diff = int64_t(a[i]) - borrow;
+        a[i] = static_cast<uint32_t>(diff);
+        borrow = diff < 0 ? 1 : 0;
+    }
+    trim(a);
+}
+
+static Limbs multiplySchoolbook(const Limbs& a, const Limbs& b)
+{
+    Limbs result(a.size() + b.size(), 0);
+    for (size_t i = 0; i < a.size(); i++) {
+        uint64_t carry = 0;
+        for (size_t j = 0; j < b.size(); j++) {
+            uint64_t product = uint64_t(a[i]) * b[j] + result[i + j] + carry;
+            result[i + j] = static_cast<uint32_t>(product);
+            carry = product >> 32;
+        }
+        result[i + b.size()] = static_cast<uint32_t>(carry);
+    }
+    trim(result);
+    return result;
+}
+
+static Limbs lowLimbs(const Limbs& limbs, size_t count)
+{
+    Limbs low(limbs.begin(), limbs.begin() + std::min(count, limbs.size()));
+    trim(low);
+    return low;
+}
+
+static Limbs highLimbs(const Limbs& limbs, size_t from)
+{
+    return from < limbs.size() ? Limbs(limbs.begin() + from, limbs.end())
+                               : Limbs();
+}
+
+static Limbs multiplyMagnitude(const Limbs& a, const Limbs& b)
+{
+    if (a.size() < KARATSUBA_THRESHOLD || b.size() < KARATSUBA_THRESHOLD) {
+        return multiplySchoolbook(a, b);
+    }
+
+    // With B the limb base, split a = a1 B^h + a0 and b = b1 B^h + b0, so
+    // a b = z2 B^2h + z1 B^h + z0, where z0 = a0 b0, z2 = a1 b1 and
+    // z1 = (a0 + a1)(b0 + b1) - z0 - z2, for three half-size products.
+    size_t half = (std::max(a.size(), b.size()) + 1) / 2;
+    Limbs a0 = lowLimbs(a, half), a1 = highLimbs(a, half);
+    Limbs b0 = lowLimbs(b, half), b1 = highLimbs(b, half);
+
+    Limbs z0 = multiplyMagnitude(a0, b0);
+    Limbs z2 = multiplyMagnitude(a1, b1);
+    addInto(a0, a1);
+    addInto(b0, b1);
+    Limbs z1 = multiplyMagnitude(a0, b0);
+    subtractFrom(z1, z0);
+    subtractFrom(z1, z2);
+
+    Limbs result = z0;
+    addInto(result, z1, half);
+    addInto(result, z2, 2 * half);
+    trim(result);
+    return result;
+}
+
+// Divides u by a single limb, returning the remainder.
+static uint32_t divideByLimb(const Limbs& u, uint32_t v, Limbs& quotient)
+{
+    quotient.assign(u.size(), 0);
+    uint64_t remainder = 0;
+    for (size_t i = u.size(); i-- > 0; ) {
+        uint64_t current = (remainder << 32) | u[i];
+        quotient[i] = static_cast<uint32_t>(current / v);
+        remainder = current % v;
+    }
+    trim(quotient);
+    return static_cast<uint32_t>(remainder);
+}
+
+// Knuth's Algorithm D (TAOCP volume 2, 4.3.1), for a divisor of at least
+// two limbs which is no larger than the dividend.
+static void divideMagnitude(const Limbs& u, const Limbs& v,
+                            Limbs& quotient, Limbs& remainder)
+{
+    const uint64_t base = uint64_t(1) << 32;
+    size_t n = v.size(), m = u.size() - n;
+
+    // D1. Normalise, so that the divisor's top limb has its top bit set,
+    // which keeps each estimated quotient limb within two of the truth.
+    int shift = __builtin_clz(v[n - 1]);
+    Limbs vn(n), un(u.size() + 1);
+    for (size_t i = n - 1; i > 0; i--) {
+        vn[i] = (v[i] << shift) |
+                static_cast<uint32_t>(uint64_t(v[i - 1]) >> (32 - shift));
+    }
+    vn[0] = v[0] << shift;
+    un[m + n] = static_cast<uint32_t>(uint64_t(u[m + n - 1]) >> (32 - shift));
+    for (size_t i = m + n - 1; i > 0; i--) {
+        un[i] = (u[i] << shift) |
+                static_cast<uint32_t>(uint64_t(u[i - 1]) >> (32 - shift));
+    }
+    un[0] = u[0] << shift;
+
+    quotient.assign(m + 1, 0);
+    for (size_t j = m + 1; j-- > 0; ) {
+        // D3. Estimate the quotient limb from the top two limbs.
+        uint64_t top = (uint64_t(un[j + n]) << 32) | un[j + n - 1];
+        uint64_t qhat = top / vn[n - 1];
+        uint64_t rhat = top % vn[n - 1];
+        while (qhat >= base ||
+               qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+            qhat--;
+            rhat += vn[n - 1];
+            if (rhat >= base) {
+                break;
+            }
+        }
+
+        // D4. Multiply and subtract.
+        int64_t borrow = 0, diff;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t product = qhat * vn[i];
+            diff = int64_t(un[i + j]) - borrow - int64_t(product & 0xFFFFFFFF);
+            un[i + j] = static_cast<uint32_t>(diff);
+            borrow = int64_t(product >> 32) - (diff >> 32);
+        }
+        diff = int64_t(un[j + n]) - borrow;
+        un[j + n] = static_cast<uint32_t>(diff);
+
+        // D5, D6. The estimate was one too large, so add the divisor back.
+        quotient[j] = static_cast<uint32_t>(qhat);
+        if (diff < 0) {
+            quotient[j]--;
+            uint64_t carry = 0;
+            for (size_t i = 0; i < n; i++) {
+                uint64_t sum = uint64_t(un[i + j]) + vn[i] + carry;
+                un[i + j] = static_cast<uint32_t>(sum);
+                carry = sum >> 32;
+            }
+            un[j + n] += static_cast<uint32_t>(carry);
+        }
+    }
+    trim(quotient);
+
+    // D8. Unnormalise the remainder.
+    remainder.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        remainder[i] = (un[i] >> shift) |
+            static_cast<uint32_t>(uint64_t(un[i + 1]) << (32 - shift));
+    }
+    trim(remainder);
+}
+
+BigInteger::BigInteger(int64_t value)
+: m_negative(value < 0)
+{
+    // Negate as unsigned, which is defined even for INT64_MIN.
+    uint64_t magnitude = m_negative ? 0 - static_cast<uint64_t>(value)
+                                    : static_cast<uint64_t>(value);
+    for ( ; magnitude != 0; magnitude >>= 32) {
+        m_limbs.push_back(static_cast<uint32_t>(magnitude));
+    }
+}
+
+BigInteger::BigInteger(const String& token)
+: m_negative(false)
+{
+    size_t i = 0;
+    bool negative = false;
+    if (token[0] == '-' || token[0] == '+') {
+        negative = token[0] == '-';
+        i = 1;
+    }
+
+    // Take nine digits at a time, the most a limb can hold.
+    Limbs multiplier;
+    while (i < token.size()) {
+        size_t digits = std::min<size_t>(9, token.size() - i);
+        uint32_t chunk = 0, scale = 1;
+        for (size_t end = i + digits; i < end; i++) {
+            chunk = chunk * 10 + (token[i] - '0');
+            scale *= 10;
+        }
+        multiplier.assign(1, scale);
+        m_limbs = multiplyMagnitude(m_limbs, multiplier);
+        addInto(m_limbs, Limbs(1, chunk));
+        trim(m_limbs);
+    }
+    m_negative = negative && !isZero();
+}
+
+BigInteger::BigInteger(const Limbs& limbs, bool negative)
+: m_limbs(limbs)
+{
+    trim(m_limbs);
+    m_negative = negative && !isZero();
+}
+
+bool BigInteger::fitsInt64() const
+{
+    if (m_limbs.size() <= 1) {
+        return true;
+    }
+    if (m_limbs.size() > 2) {
+        return false;
+    }
+    uint64_t magnitude = (uint64_t(m_limbs[1]) << 32) | m_limbs[0];
+    return magnitude <= (m_negative ? uint64_t(1) << 63
+                                    : (uint64_t(1) << 63) - 1);
+}
+
+int64_t BigInteger::toInt64() const
+{
+    uint64_t magnitude = 0;
+    for (size_t i = m_limbs.size(); i-- > 0; ) {
+        magnitude = (magnitude << 32) | m_limbs[i];
+    }
+    return static_cast<int64_t>(m_negative ? 0 - magnitude : magnitude);
+}
+
+double BigInteger::toDouble() const
+{
+    double value = 0;
+    for (size_t i = m_limbs.size(); i-- > 0; ) {
+        value = value * 4294967296.0 + m_limbs[i];
+    }
+    return m_negative ? -value : value;
+}
+
+String BigInteger::toString() const
+{
+    if (isZero()) {
+        return "0";
+    }
+
+    // Peel off nine decimal digits at a time, least significant first.
+    std::vector<uint32_t> chunks;
+    Limbs rest = m_limbs;
+    while (!rest.empty()) {
+        Limbs quotient;
+        chunks.push_back(divideByLimb(rest, 1000000000, quotient));
+        rest.swap(quotient);
+    }
+
+    String str = m_negative ? "-" : "";
+    str += std::to_string(chunks.back());
+    for (size_t i = chunks.size() - 1; i-- > 0; ) {
+        String digits = std::to_string(chunks[i]);
+        str += String(9 - digits.size(), '0') + digits;
+    }
+    return str;
+}
+
+int BigInteger::compare(const BigInteger& that) const
+{
+    if (m_negative != that.m_negative) {
+        return m_negative ? -1 : 1;
+    }
+    int order = compareMagnitude(m_limbs, that.m_limbs);
+    return m_negative ? -order : order;
+}
+
+BigInteger BigInteger::operator - () const
+{
+    return BigInteger(m_limbs, !m_negative);
+}
+
+BigInteger BigInteger::addSigned(const BigInteger& a, const BigInteger& b,
+                                 bool negateB)
+{
+    bool bNegative = b.m_negative != negateB;
+    if (a.m_negative == bNegative) {
+        Limbs sum = a.m_limbs;
+        addInto(sum, b.m_limbs);
+        return BigInteger(sum, a.m_negative);
+    }
+
+    // The signs differ, so subtract the smaller magnitude from the larger,
+    // and take the sign of the larger.
+    if (compareMagnitude(a.m_limbs, b.m_limbs) >= 0) {
+        Limbs diff = a.m_limbs;
+        subtractFrom(diff, b.m_limbs);
+        return BigInteger(diff, a.m_negative);
+    }
+    Limbs diff = b.m_limbs;
+    subtractFrom(diff, a.m_limbs);
+    return BigInteger(diff, bNegative);
+}
+
+void BigInteger::divide(const BigInteger& a, const BigInteger& b,
+                        BigInteger* quotient, BigInteger* remainder)
+{
+    MAL_CHECK(!b.isZero(), "Division by zero");
+
+    Limbs q, r;
+    if (compareMagnitude(a.m_limbs, b.m_limbs) < 0) {
+        r = a.m_limbs;
+    }
+    else if (b.m_limbs.size() == 1) {
+        uint32_t rem = divideByLimb(a.m_limbs, b.m_limbs[0], q);
+        if (rem != 0) {
+            r.push_back(rem);
+        }
+    }
+    else {
+        divideMagnitude(a.m_limbs, b.m_limbs, q, r);
+    }
+
+    // Truncating division: the remainder takes the dividend's sign.
+    if (quotient) {
+        *quotient = BigInteger(q, a.m_negative != b.m_negative);
+    }
+    if (remainder) {
+        *remainder = BigInteger(r, a.m_negative);
+    }
+}
+
+BigInteger operator + (const BigInteger& a, const BigInteger& b)
+{
+    return BigInteger::addSigned(a, b, false);
+}
+
+BigInteger operator - (const BigInteger& a, const BigInteger& b)
+{
+    return BigInteger::addSigned(a, b, true);
+}
+
+BigInteger operator * (const BigInteger& a, const BigInteger& b)
+{
+    return BigInteger(multiplyMagnitude(a.m_limbs, b.m_limbs),
+                      a.m_negative != b.m_negative);
+}
+
+BigInteger operator / (const BigInteger& a, const BigInteger& b)
+{
+    BigInteger quotient;
+    BigInteger::divide(a, b, &quotient, NULL);
+    return quotient;
+}
+
+BigInteger operator % (const BigInteger& a, const BigInteger& b)
+{
+    BigInteger remainder;
+    BigInteger::divide(a, b, NULL, &remainder);
+    return remainder;
+}
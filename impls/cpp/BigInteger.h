@@ -0,0 +1,126 @@
+#ifndef INCLUDE_BIGINTEGER_H
+#define INCLUDE_BIGINTEGER_H
+
+#include "String.h"
+
+#include <stdint.h>
+#include <vector>
+
+//  An arbitrary-precision integer, held as a sign and a magnitude of 32-bit
+//  limbs, least significant first, with no high zero limbs (so zero has no
+//  limbs at all).
+//
+//  Multiplication switches from the schoolbook method to Karatsuba's once
+//  both operands are long enough for it to pay, and division is Knuth's
+//  Algorithm D. Division truncates towards zero, as it does for int64_t,
+//  and fails on a zero divisor.
+
+class BigInteger {
+public:
+    BigInteger() : m_negative(false) { }
+    BigInteger(int64_t value);
+    // The token must be an optionally signed string of decimal digits.
+    explicit BigInteger(const String& token);
+
+    bool isZero() const { return m_limbs.empty(); }
+    bool isNegative() const { return m_negative; }
+    bool fitsInt64() const;
+    int64_t toInt64() const; // only if fitsInt64()
+    double toDouble() const;
+    String toString() const;
+
+    const std::vector<uint32_t>& limbs() const { return m_limbs; }
+
+    // Returns <0, 0 or >0 as *this is less than, equal to or greater than
+    // that.
+    int compare(const BigInteger& that) const;
+
+    BigInteger operator - () const;
+
+    friend BigInteger operator + (const BigInteger& a, const BigInteger& b);
+    friend BigInteger operator - (const BigInteger& a, const BigInteger& b);
+    friend BigInteger operator * (const BigInteger& a, const BigInteger& b);
+    friend BigInteger operator / (const BigInteger& a, const BigInteger& b);
+    friend BigInteger operator % (const BigInteger& a, const BigInteger& b);
+
+    bool operator <  (const BigInteger& that) const {
+        return compare(that) < 0;
+    }
+    bool operator <= (const BigInteger& that) const {
+        return compare(that) <= 0;
+    }
+    bool operator >  (const BigInteger& that) const {
+        return compare(that) > 0;
+    }
+    bool operator >= (const BigInteger& that) const {
+        return compare(that) >= 0;
+    }
+
+private:
+    typedef std::vector<uint32_t> Limbs;
+
+    BigInteger(const Limbs& limbs, bool negative);
+
+    static BigInteger addSigned(const BigInteger& a, const BigInteger& b,
+                                bool negateB);
+    static void divide(const BigInteger& a, const BigInteger& b,
+                       BigInteger* quotient, BigInteger* remainder);
+
+    Limbs m_limbs;
+    bool  m_negative;
+};
+
+//  Each of these sets result to the wrapped result of the operation, and
+//  returns true if it overflowed. They use the compiler's builtins where it
+//  has them (GCC 5 and clang), and portable checks otherwise.
+
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+
+inline bool addOverflows(int64_t a, int64_t b, int64_t& result)
+{
+    return __builtin_add_overflow(a, b, &result);
+}
+
+inline bool subtractOverflows(int64_t a, int64_t b, int64_t& result)
+{
+    return __builtin_sub_overflow(a, b, &result);
+}
+
+inline bool multiplyOverflows(int64_t a, int64_t b, int64_t& result)
+{
+    return __builtin_mul_overflow(a, b, &result);
+}
+
+#else
+
+inline bool addOverflows(int64_t a, int64_t b, int64_t& result)
+{
+    result = static_cast<int64_t>(static_cast<uint64_t>(a) +
+                                  static_cast<uint64_t>(b));
+    // Overflow gives a result whose sign differs from both operands'.
+    return ((a ^ result) & (b ^ result)) < 0;
+}
+
+inline bool subtractOverflows(int64_t a, int64_t b, int64_t& result)
+{
+    result = static_cast<int64_t>(static_cast<uint64_t>(a) -
+                                  static_cast<uint64_t>(b));
+    return ((a ^ b) & (a ^ result)) < 0;
+}
+
+inline bool multiplyOverflows(int64_t a, int64_t b, int64_t& result)
+{
+    result = static_cast<int64_t>(static_cast<uint64_t>(a) *
+                                  static_cast<uint64_t>(b));
+    if (a > 0) {
+        return b > INT64_MAX / a || b < INT64_MIN / a;
+    }
+    if (a < -1) {
+        return b < INT64_MAX / a || b > INT64_MIN / a;
+    }
+    return a == -1 && b == INT64_MIN;
+}
+
+#endif
+
+#endif // INCLUDE_BIGINTEGER_H
@@ -0,0 +1,73 @@
+#ifndef INCLUDE_COMPRESSEDPTR_H
+#define INCLUDE_COMPRESSEDPTR_H
+
+#include "Nursery.h"
+#include "RefCountedPtr.h"
+
+#include <stdint.h>
+
+//  A counted reference held in 32 bits, as an offset into the Nursery's
+//  region, for the slots of the persistent collections when built with
+//  MAL_COMPRESSED_REFS defined (make REFS=compressed). Every counted object
+//  is then allocated in that region.
+//
+//  It converts to and from RefCountedPtr, so a slot reads as one; but a
+//  reference to one can't be taken, only a copy.
+
+template<class T>
+class CompressedPtr {
+public:
+    CompressedPtr() : m_offset(0) { }
+
+    CompressedPtr(const RefCountedPtr<T>& ptr) : m_offset(0)
+    { acquire(ptr.ptr()); }
+
+    CompressedPtr(const CompressedPtr& rhs) : m_offset(0)
+    { acquire(rhs.ptr()); }
+
+    const CompressedPtr& operator = (const CompressedPtr& rhs) {
+        acquire(rhs.ptr());
+        return *this;
+    }
+
+    ~CompressedPtr() {
+        release();
+    }
+
+    operator RefCountedPtr<T> () const { return RefCountedPtr<T>(ptr()); }
+
+    bool operator == (const CompressedPtr& rhs) const {
+        return m_offset == rhs.m_offset;
+    }
+
+    bool operator != (const CompressedPtr& rhs) const {
+        return m_offset != rhs.m_offset;
+    }
+
+    operator bool () const {
+        return m_offset != 0;
+    }
+
+    T* operator -> () const { return ptr(); }
+    T* ptr() const { return static_cast<T*>(Nursery::address(m_offset)); }
+
+private:
+    void acquire(T* object) {
+        if (object != NULL) {
+            object->acquire();
+        }
+        release();
+        m_offset = Nursery::offsetOf(object);
+    }
+
+    void release() {
+        T* object = ptr();
+        if ((object != NULL) && object->release()) {
+            RefCounted::destroy(object);
+        }
+    }
+
+    uint32_t m_offset;
+};
+
+#endif // INCLUDE_COMPRESSEDPTR_H
@@ -4,8 +4,10 @@
 #include "Types.h"
 
 #include <chrono>
+#include <climits>
 #include <fstream>
 #include <iostream>
+#include <memory>
 
 #define CHECK_ARGS_IS(expected) \
     checkArgsIs(name.c_str(), expected, \
@@ -21,6 +23,18 @@
 
 static String printValues(malValueIter begin, malValueIter end,
                            const String& sep, bool readably);
+static malValuePtr sortedRange(const String& name, bool ascending,
+                               malValueIter argsBegin, malValueIter argsEnd);
+static bool isUnique(const malValuePtr& value);
+static malValuePtr toIntVector(const malValuePtr& coll);
+static double toDouble(const malValuePtr& value);
+static BigInteger toBigInteger(const malValuePtr& value);
+static bool divideOverflows(int64_t lhs, int64_t rhs, int64_t& result);
+template <class Op, class ValueOp>
+static malValuePtr intVectorOp(const malValuePtr& lhs, const malValuePtr& rhs,
+                               Op op, ValueOp valueOp);
+static malValuePtr reuseAsList(const malValuePtr& seq,
+                               const RRBVector& items);
 
 static StaticList<malBuiltIn*> handlers;
 
@@ -49,82 +63,126 @@ static StaticList<malBuiltIn*> handlers;
         return mal::boolean(*argsBegin == mal::constant()); \
     }
 
-#define BUILTIN_INTOP(op, checkDivByZero) \
+//  The general case, once the int64_t fast path has been ruled out: if
+//  either argument is a double then both are taken as doubles, otherwise as
+//  bignums.
+#define SLOW_NUMBER_OP(lhs, rhs, op, makeInteger, makeDouble) \
+    if (DYNAMIC_CAST(malDouble, lhs) || DYNAMIC_CAST(malDouble, rhs)) { \
+        return makeDouble(toDouble(lhs) op toDouble(rhs)); \
+    } \
+    return makeInteger(toBigInteger(lhs) op toBigInteger(rhs))
+
+//  Applies op item by item when either argument is an int-vector, with
+//  overflows checking each result as in INTEGER_OP. If any overflows, or
+//  the items are paired with a bignum or a double, they're all taken as
+//  that instead, and each result is made as SLOW_NUMBER_OP makes it.
+#define INT_VECTOR_OP(op, overflows, makeInteger, makeDouble) \
+    if (DYNAMIC_CAST(malIntVector, argsBegin[0]) || \
+        DYNAMIC_CAST(malIntVector, argsBegin[1])) { \
+        return intVectorOp(argsBegin[0], argsBegin[1], \
+            [](int64_t lhs, int64_t rhs, int64_t& result) { \
+                return overflows(lhs, rhs, result); \
+            }, \
+            [](const malValuePtr& lhs, const malValuePtr& rhs) \
+                    -> malValuePtr { \
+                SLOW_NUMBER_OP(lhs, rhs, op, makeInteger, makeDouble); \
+            }); \
+    }
+
+//  Two integers take the fast path unless overflows says the result doesn't
+//  fit in an int64_t, in which case it's worked out again with bignums.
+#define INTEGER_OP(op, overflows, itemwise) \
+    const malInteger* lhs = DYNAMIC_CAST(malInteger, argsBegin[0]); \
+    const malInteger* rhs = DYNAMIC_CAST(malInteger, argsBegin[1]); \
+    int64_t result; \
+    if (lhs && rhs && !overflows(lhs->value(), rhs->value(), result)) { \
+        return mal::integer(result); \
+    } \
+    if (itemwise) { \
+        INT_VECTOR_OP(op, overflows, mal::integer, mal::real); \
+    } \
+    SLOW_NUMBER_OP(argsBegin[0], argsBegin[1], op, mal::integer, mal::real)
+
+#define BUILTIN_INTOP(op, overflows, itemwise) \
+    BUILTIN(#op) { \
+        CHECK_ARGS_IS(2); \
+        INTEGER_OP(op, overflows, itemwise); \
+    }
+
+//  As addOverflows and the others, for an operation that can't overflow.
+#define NEVER_OVERFLOWS(op) \
+    [](int64_t lhs, int64_t rhs, int64_t& result) { \
+        result = lhs op rhs; \
+        return false; \
+    }
+
+#define BUILTIN_COMPARE(op) \
     BUILTIN(#op) { \
         CHECK_ARGS_IS(2); \
-        ARG(malInteger, lhs); \
-        ARG(malInteger, rhs); \
-        if (checkDivByZero) { \
-            MAL_CHECK(rhs->value() != 0, "Division by zero"); \
+        const malInteger* lhs = DYNAMIC_CAST(malInteger, argsBegin[0]); \
+        const malInteger* rhs = DYNAMIC_CAST(malInteger, argsBegin[1]); \
+        if (lhs && rhs) { \
+            return mal::boolean(lhs->value() op rhs->value()); \
         } \
-        return mal::integer(lhs->value() op rhs->value()); \
+        INT_VECTOR_OP(op, NEVER_OVERFLOWS(op), mal::integer, mal::integer); \
+        SLOW_NUMBER_OP(argsBegin[0], argsBegin[1], op, \
+                       mal::boolean, mal::boolean); \
     }
 
 BUILTIN_ISA("atom?",        malAtom);
+BUILTIN_ISA("int-vector?",  malIntVector);
 BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
-BUILTIN_ISA("map?",         malHash);
-BUILTIN_ISA("number?",      malInteger);
+BUILTIN_ISA("map?",         malMap);
+BUILTIN_ISA("record?",      malRecord);
 BUILTIN_ISA("sequential?",  malSequence);
+BUILTIN_ISA("set?",         malSet);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
 
-BUILTIN_INTOP(+,            false);
-BUILTIN_INTOP(/,            true);
-BUILTIN_INTOP(*,            false);
-BUILTIN_INTOP(%,            true);
+BUILTIN_INTOP(+,            addOverflows,       true);
+BUILTIN_INTOP(/,            divideOverflows,    false);
+BUILTIN_INTOP(*,            multiplyOverflows,  true);
+
+BUILTIN_COMPARE(<=);
+BUILTIN_COMPARE(>=);
+BUILTIN_COMPARE(<);
+BUILTIN_COMPARE(>);
 
 BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
-BUILTIN("-")
-{
-    int argCount = CHECK_ARGS_BETWEEN(1, 2);
-    ARG(malInteger, lhs);
-    if (argCount == 1) {
-        return mal::integer(- lhs->value());
-    }
-
-    ARG(malInteger, rhs);
-    return mal::integer(lhs->value() - rhs->value());
-}
-
-BUILTIN("<=")
+BUILTIN("%")
 {
     CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
-
-    return mal::boolean(lhs->value() <= rhs->value());
-}
-
-BUILTIN(">=")
-{
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
-
-    return mal::boolean(lhs->value() >= rhs->value());
-}
-
-BUILTIN("<")
-{
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    const malInteger* lhs = DYNAMIC_CAST(malInteger, argsBegin[0]);
+    const malInteger* rhs = DYNAMIC_CAST(malInteger, argsBegin[1]);
+    // INT64_MIN % -1 overflows in C++, although the result is 0.
+    if (lhs && rhs && rhs->value() != 0 && rhs->value() != -1) {
+        return mal::integer(lhs->value() % rhs->value());
+    }
 
-    return mal::boolean(lhs->value() < rhs->value());
+    return mal::integer(toBigInteger(argsBegin[0]) %
+                        toBigInteger(argsBegin[1]));
 }
 
-BUILTIN(">")
+BUILTIN("-")
 {
-    CHECK_ARGS_IS(2);
-    ARG(malInteger, lhs);
-    ARG(malInteger, rhs);
+    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    if (argCount == 1) {
+        if (const malDouble* value = DYNAMIC_CAST(malDouble, *argsBegin)) {
+            return mal::real(- value->value());
+        }
+        const malInteger* value = DYNAMIC_CAST(malInteger, *argsBegin);
+        if (value && value->value() != INT64_MIN) {
+            return mal::integer(- value->value());
+        }
+        return mal::integer(- toBigInteger(*argsBegin));
+    }
 
-    return mal::boolean(lhs->value() > rhs->value());
+    INTEGER_OP(-, subtractOverflows, true);
 }
 
 BUILTIN("=")
@@ -146,9 +204,7 @@ BUILTIN("apply")
 
     // Then append the argument as a list.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
-    for (int i = 0; i < lastArg->count(); i++) {
-        args.push_back(lastArg->item(i));
-    }
+    args.insert(args.end(), lastArg->begin(), lastArg->end());
 
     return APPLY(op, args.begin(), args.end());
 }
@@ -156,9 +212,27 @@ BUILTIN("apply")
 BUILTIN("assoc")
 {
     CHECK_ARGS_AT_LEAST(1);
-    ARG(malHash, hash);
+    if (isUnique(*argsBegin)) {
+        if (malHash* hash = DYNAMIC_CAST(malHash, *argsBegin)) {
+            hash->assocInPlace(argsBegin + 1, argsEnd);
+            return *argsBegin;
+        }
+        if (malRecord* record = DYNAMIC_CAST(malRecord, *argsBegin)) {
+            record->assocInPlace(argsBegin + 1, argsEnd);
+            return *argsBegin;
+        }
+    }
+    ARG(malMap, map);
 
-    return hash->assoc(argsBegin, argsEnd);
+    return map->assoc(argsBegin, argsEnd);
+}
+
+BUILTIN("assoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+
+    return transient->assoc(argsBegin, argsEnd);
 }
 
 BUILTIN("atom")
@@ -168,44 +242,82 @@ BUILTIN("atom")
     return mal::atom(*argsBegin);
 }
 
+// Returns the number of bytes reclaimed.
+BUILTIN("collect-cycles")
+{
+    CHECK_ARGS_IS(0);
+    return mal::integer(static_cast<int64_t>(RefCounted::collectCycles()));
+}
+
+BUILTIN("compare")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr lhs = *argsBegin++;
+    malValuePtr rhs = *argsBegin++;
+
+    return mal::integer(compareValues(lhs, rhs));
+}
+
 BUILTIN("concat")
 {
-    int count = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = VALUE_CAST(malSequence, *it);
-        count += seq->count();
+    if (argsBegin == argsEnd) {
+        return mal::list(new malValueVec(0));
     }
 
-    malValueVec* items = new malValueVec(count);
-    int offset = 0;
-    for (auto it = argsBegin; it != argsEnd; ++it) {
-        const malSequence* seq = STATIC_CAST(malSequence, *it);
-        std::copy(seq->begin(), seq->end(), items->begin() + offset);
-        offset += seq->count();
+    // Once the items are unshared, the rest are appended to them in place.
+    malSequence* first = VALUE_CAST(malSequence, *argsBegin);
+    RRBVector items = isUnique(*argsBegin) ? first->takeItems()
+                                           : first->items();
+    for (auto it = argsBegin + 1; it != argsEnd; ++it) {
+        const malSequence* seq = VALUE_CAST(malSequence, *it);
+        items.concatInPlace(seq->items());
     }
 
-    return mal::list(items);
+    return reuseAsList(*argsBegin, items);
 }
 
 BUILTIN("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
+    if (isUnique(*argsBegin)) {
+        if (malHashSet* set = DYNAMIC_CAST(malHashSet, *argsBegin)) {
+            set->conjInPlace(argsBegin + 1, argsEnd);
+            return *argsBegin;
+        }
+        if (malSequence* seq = DYNAMIC_CAST(malSequence, *argsBegin)) {
+            seq->conjInPlace(argsBegin + 1, argsEnd);
+            return *argsBegin;
+        }
+    }
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return set->conj(argsBegin + 1, argsEnd);
+    }
     ARG(malSequence, seq);
 
     return seq->conj(argsBegin, argsEnd);
 }
 
+BUILTIN("conj!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+
+    return transient->conj(argsBegin, argsEnd);
+}
+
 BUILTIN("cons")
 {
     CHECK_ARGS_IS(2);
     malValuePtr first = *argsBegin++;
+    if (isUnique(*argsBegin)) {
+        malSequence* rest = VALUE_CAST(malSequence, *argsBegin);
+        RRBVector items = rest->takeItems();
+        items.pushFrontInPlace(first);
+        return reuseAsList(*argsBegin, items);
+    }
     ARG(malSequence, rest);
 
-    malValueVec* items = new malValueVec(1 + rest->count());
-    items->at(0) = first;
-    std::copy(rest->begin(), rest->end(), items->begin() + 1);
-
-    return mal::list(items);
+    return mal::list(rest->items().pushFront(first));
 }
 
 BUILTIN("contains?")
@@ -214,8 +326,11 @@ BUILTIN("contains?")
     if (*argsBegin == mal::nilValue()) {
         return *argsBegin;
     }
-    ARG(malHash, hash);
-    return mal::boolean(hash->contains(*argsBegin));
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return mal::boolean(set->contains(*++argsBegin));
+    }
+    ARG(malMap, map);
+    return mal::boolean(map->contains(*argsBegin));
 }
 
 BUILTIN("count")
@@ -224,6 +339,18 @@ BUILTIN("count")
     if (*argsBegin == mal::nilValue()) {
         return mal::integer(0);
     }
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return mal::integer(set->count());
+    }
+    if (const malMap* map = DYNAMIC_CAST(malMap, *argsBegin)) {
+        return mal::integer(map->count());
+    }
+    if (const malTransient* t = DYNAMIC_CAST(malTransient, *argsBegin)) {
+        return mal::integer(t->count());
+    }
+    if (const malIntVector* ints = DYNAMIC_CAST(malIntVector, *argsBegin)) {
+        return mal::integer(ints->count());
+    }
 
     ARG(malSequence, seq);
     return mal::integer(seq->count());
@@ -237,17 +364,98 @@ BUILTIN("deref")
     return atom->deref();
 }
 
+BUILTIN("difference")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malSet, first);
+
+    // Collect the items to remove, walking whichever set is smaller.
+    malValueVec removed;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSet* set = VALUE_CAST(malSet, *it);
+        if (set->count() < first->count()) {
+            set->forEach([&removed](const malValuePtr& item) {
+                removed.push_back(item);
+                return true;
+            });
+        }
+        else {
+            first->forEach([&removed, set](const malValuePtr& item) {
+                if (set->contains(item)) {
+                    removed.push_back(item);
+                }
+                return true;
+            });
+        }
+    }
+    return first->disj(removed.begin(), removed.end());
+}
+
+BUILTIN("disj")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    if (isUnique(*argsBegin)) {
+        if (malHashSet* set = DYNAMIC_CAST(malHashSet, *argsBegin)) {
+            set->disjInPlace(argsBegin + 1, argsEnd);
+            return *argsBegin;
+        }
+    }
+    ARG(malSet, set);
+
+    return set->disj(argsBegin, argsEnd);
+}
+
+BUILTIN("disj!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
+
+    return transient->disj(argsBegin, argsEnd);
+}
+
 BUILTIN("dissoc")
 {
     CHECK_ARGS_AT_LEAST(1);
-    ARG(malHash, hash);
+    if (isUnique(*argsBegin)) {
+        if (malHash* hash = DYNAMIC_CAST(malHash, *argsBegin)) {
+            hash->dissocInPlace(argsBegin + 1, argsEnd);
+            return *argsBegin;
+        }
+    }
+    ARG(malMap, map);
+
+    return map->dissoc(argsBegin, argsEnd);
+}
+
+BUILTIN("dissoc!")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    ARG(malTransient, transient);
 
-    return hash->dissoc(argsBegin, argsEnd);
+    return transient->dissoc(argsBegin, argsEnd);
+}
+
+BUILTIN("dot")
+{
+    CHECK_ARGS_IS(2);
+    malValuePtr lhs = toIntVector(*argsBegin++);
+    malValuePtr rhs = toIntVector(*argsBegin++);
+
+    return STATIC_CAST(malIntVector, lhs)->dot(*STATIC_CAST(malIntVector, rhs));
 }
 
 BUILTIN("empty?")
 {
     CHECK_ARGS_IS(1);
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        return mal::boolean(set->isEmpty());
+    }
+    if (const malMap* map = DYNAMIC_CAST(malMap, *argsBegin)) {
+        return mal::boolean(map->isEmpty());
+    }
+    if (const malIntVector* ints = DYNAMIC_CAST(malIntVector, *argsBegin)) {
+        return mal::boolean(ints->isEmpty());
+    }
     ARG(malSequence, seq);
 
     return mal::boolean(seq->isEmpty());
@@ -256,6 +464,7 @@ BUILTIN("empty?")
 BUILTIN("eval")
 {
     CHECK_ARGS_IS(1);
+    RefCounted::AllocationBudget budget(RefCounted::evaluationBudget());
     return EVAL(*argsBegin, NULL);
 }
 
@@ -265,6 +474,10 @@ BUILTIN("first")
     if (*argsBegin == mal::nilValue()) {
         return mal::nilValue();
     }
+    if (const malIntVector* ints = DYNAMIC_CAST(malIntVector, *argsBegin)) {
+        return ints->isEmpty() ? mal::nilValue()
+                               : mal::integer(ints->item(0));
+    }
     ARG(malSequence, seq);
     return seq->first();
 }
@@ -288,8 +501,18 @@ BUILTIN("get")
     if (*argsBegin == mal::nilValue()) {
         return *argsBegin;
     }
-    ARG(malHash, hash);
-    return hash->get(*argsBegin);
+    if (const malSet* set = DYNAMIC_CAST(malSet, *argsBegin)) {
+        malValuePtr item = *++argsBegin;
+        return set->contains(item) ? item : mal::nilValue();
+    }
+    ARG(malMap, map);
+    return map->get(*argsBegin);
+}
+
+BUILTIN("hash")
+{
+    CHECK_ARGS_IS(1);
+    return mal::integer((*argsBegin)->hash());
 }
 
 BUILTIN("hash-map")
@@ -297,11 +520,48 @@ BUILTIN("hash-map")
     return mal::hash(argsBegin, argsEnd, true);
 }
 
+BUILTIN("hash-set")
+{
+    return mal::set(argsBegin, argsEnd, true);
+}
+
+BUILTIN("intersection")
+{
+    CHECK_ARGS_AT_LEAST(1);
+
+    // Only the smallest set's items can possibly be in the result.
+    const malSet* smallest = NULL;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSet* set = VALUE_CAST(malSet, *it);
+        if (!smallest || set->count() < smallest->count()) {
+            smallest = set;
+        }
+    }
+
+    malValueVec removed;
+    smallest->forEach([&removed, argsBegin, argsEnd](const malValuePtr& item) {
+        for (auto it = argsBegin; it != argsEnd; ++it) {
+            if (!STATIC_CAST(malSet, *it)->contains(item)) {
+                removed.push_back(item);
+                break;
+            }
+        }
+        return true;
+    });
+    return smallest->disj(removed.begin(), removed.end());
+}
+
+BUILTIN("int-vector")
+{
+    CHECK_ARGS_IS(1);
+    return toIntVector(*argsBegin);
+}
+
 BUILTIN("keys")
 {
     CHECK_ARGS_IS(1);
-    ARG(malHash, hash);
-    return hash->keys();
+    ARG(malMap, map);
+    return map->keys();
 }
 
 BUILTIN("keyword")
@@ -337,14 +597,49 @@ BUILTIN("map")
 
     const int length = source->count();
     malValueVec* items = new malValueVec(length);
+    malValueVec arg(1);
     auto it = source->begin();
-    for (int i = 0; i < length; i++) {
-      items->at(i) = APPLY(op, it+i, it+i+1);
+    for (int i = 0; i < length; i++, ++it) {
+      arg[0] = *it;
+      items->at(i) = APPLY(op, arg.begin(), arg.end());
     }
 
     return  mal::list(items);
 }
 
+BUILTIN("max")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr ints = toIntVector(*argsBegin);
+    return mal::integer(STATIC_CAST(malIntVector, ints)->max());
+}
+
+// Returns a map from the name of each counted type to the number of its
+// objects which are live, and the bytes they take up.
+BUILTIN("mem-stats")
+{
+    CHECK_ARGS_IS(0);
+
+    // Read before making any of the result, which adds to them.
+    std::vector<LiveCount> counts;
+    for (const LiveCount* count = LiveCount::first(); count;
+         count = count->next) {
+        counts.push_back(*count);
+    }
+
+    malValueVec entries;
+    for (auto it = counts.begin(); it != counts.end(); ++it) {
+        malValueVec stats;
+        stats.push_back(mal::keyword(":objects"));
+        stats.push_back(mal::integer(static_cast<int64_t>(it->objects)));
+        stats.push_back(mal::keyword(":bytes"));
+        stats.push_back(mal::integer(static_cast<int64_t>(it->bytes)));
+        entries.push_back(mal::string(it->name));
+        entries.push_back(mal::hash(stats.begin(), stats.end(), true));
+    }
+    return mal::hash(entries.begin(), entries.end(), true);
+}
+
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
@@ -353,16 +648,48 @@ BUILTIN("meta")
     return obj->meta();
 }
 
+BUILTIN("min")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr ints = toIntVector(*argsBegin);
+    return mal::integer(STATIC_CAST(malIntVector, ints)->min());
+}
+
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
+    if (const malIntVector* ints = DYNAMIC_CAST(malIntVector, *argsBegin)) {
+        ++argsBegin;
+        ARG(malInteger, index);
+
+        int64_t i = index->value();
+        MAL_CHECK(i >= 0 && i < ints->count(), "Index out of range");
+
+        return mal::integer(ints->item(static_cast<int>(i)));
+    }
     ARG(malSequence, seq);
     ARG(malInteger,  index);
 
-    int i = index->value();
+    int64_t i = index->value();
     MAL_CHECK(i >= 0 && i < seq->count(), "Index out of range");
 
-    return seq->item(i);
+    return seq->item(static_cast<int>(i));
+}
+
+BUILTIN("number?")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(DYNAMIC_CAST(malInteger, *argsBegin) ||
+                        DYNAMIC_CAST(malBigInteger, *argsBegin) ||
+                        DYNAMIC_CAST(malDouble, *argsBegin));
+}
+
+BUILTIN("persistent!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malTransient, transient);
+
+    return transient->persistent();
 }
 
 BUILTIN("pr-str")
@@ -398,6 +725,34 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("record")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malRecordType, type);
+    ARG(malMap, map);
+
+    return type->fromMap(map);
+}
+
+BUILTIN("record-type")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malString, typeName);
+    ARG(malSequence, fields);
+
+    // Fields may be named by symbols, as defrecord passes them, or keywords.
+    malValueVec keywords;
+    for (auto it = fields->begin(), end = fields->end(); it != end; ++it) {
+        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, *it)) {
+            keywords.push_back(mal::keyword(":" + symbol->value()));
+        }
+        else {
+            keywords.push_back(VALUE_CAST(malKeyword, *it));
+        }
+    }
+    return new malRecordType(new RecordLayout(typeName->value(), keywords));
+}
+
 BUILTIN("reset!")
 {
     CHECK_ARGS_IS(2);
@@ -411,10 +766,23 @@ BUILTIN("rest")
     if (*argsBegin == mal::nilValue()) {
         return mal::list(new malValueVec(0));
     }
+    if (isUnique(*argsBegin)) {
+        malSequence* seq = VALUE_CAST(malSequence, *argsBegin);
+        RRBVector items = seq->takeItems();
+        if (!items.isEmpty()) {
+            items.popFrontInPlace();
+        }
+        return reuseAsList(*argsBegin, items);
+    }
     ARG(malSequence, seq);
     return seq->rest();
 }
 
+BUILTIN("rsubseq")
+{
+    return sortedRange(name, false, argsBegin, argsEnd);
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
@@ -424,7 +792,16 @@ BUILTIN("seq")
     }
     if (const malSequence* seq = DYNAMIC_CAST(malSequence, arg)) {
         return seq->isEmpty() ? mal::nilValue()
-                              : mal::list(seq->begin(), seq->end());
+                              : mal::list(seq->items());
+    }
+    if (const malSet* set = DYNAMIC_CAST(malSet, arg)) {
+        return set->isEmpty() ? mal::nilValue() : set->seq();
+    }
+    if (const malIntVector* ints = DYNAMIC_CAST(malIntVector, arg)) {
+        return ints->isEmpty() ? mal::nilValue() : ints->seq();
+    }
+    if (const malMap* map = DYNAMIC_CAST(malMap, arg)) {
+        return map->isEmpty() ? mal::nilValue() : map->seq();
     }
     if (const malString* strVal = DYNAMIC_CAST(malString, arg)) {
         const String str = strVal->value();
@@ -441,6 +818,52 @@ BUILTIN("seq")
     MAL_FAIL("%s is not a string or sequence", arg->print(true).c_str());
 }
 
+BUILTIN("set")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr arg = *argsBegin;
+    if (arg == mal::nilValue()) {
+        return mal::set(HAMT());
+    }
+    if (DYNAMIC_CAST(malHashSet, arg)) {
+        return arg;
+    }
+    malValueVec items;
+    if (const malSet* set = DYNAMIC_CAST(malSet, arg)) {
+        set->forEach([&items](const malValuePtr& item) {
+            items.push_back(item);
+            return true;
+        });
+    }
+    else {
+        ARG(malSequence, seq);
+        items.assign(seq->begin(), seq->end());
+    }
+    return mal::set(items.begin(), items.end(), true);
+}
+
+// Sets what each later top-level evaluation, and each call to eval, may
+// allocate; 0 for no limit. The current evaluation's limit is unchanged.
+BUILTIN("set-alloc-budget!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malInteger, bytes);
+    MAL_CHECK(bytes->value() >= 0, "An allocation budget can't be negative");
+
+    RefCounted::setEvaluationBudget(static_cast<size_t>(bytes->value()));
+    return mal::nilValue();
+}
+
+BUILTIN("set-release-budget!")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malInteger, count);
+    MAL_CHECK(count->value() >= 0 && count->value() <= INT_MAX,
+              "A release budget must be from 0 to %d", INT_MAX);
+
+    RefCounted::setReleaseBudget(static_cast<int>(count->value()));
+    return mal::nilValue();
+}
 
 BUILTIN("slurp")
 {
@@ -461,11 +884,73 @@ BUILTIN("slurp")
     return mal::string(data);
 }
 
+BUILTIN("sorted-map")
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "sorted-map requires an even-sized list");
+
+    AVLTree map;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        malValuePtr key = *it++;
+        map = map.assoc(key, *it);
+    }
+    return mal::sortedMap(map);
+}
+
+BUILTIN("sorted-set")
+{
+    AVLTree items;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.assoc(*it, *it);
+    }
+    return mal::sortedSet(items);
+}
+
+BUILTIN("sorted?")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr arg = *argsBegin;
+
+    return mal::boolean(DYNAMIC_CAST(malSortedMap, arg) ||
+                        DYNAMIC_CAST(malSortedSet, arg));
+}
+
 BUILTIN("str")
 {
     return mal::string(printValues(argsBegin, argsEnd, "", false));
 }
 
+BUILTIN("subseq")
+{
+    return sortedRange(name, true, argsBegin, argsEnd);
+}
+
+BUILTIN("subvec")
+{
+    int argCount = CHECK_ARGS_BETWEEN(2, 3);
+    ARG(malVector, vec);
+    ARG(malInteger, start);
+
+    // Checked as they are, before they're narrowed to int.
+    int64_t end = vec->count();
+    if (argCount == 3) {
+        ARG(malInteger, endIndex);
+        end = endIndex->value();
+    }
+    MAL_CHECK(start->value() >= 0 && start->value() <= end &&
+              end <= vec->count(), "Index out of range");
+
+    return mal::vector(vec->items().take(static_cast<int>(end))
+                                   .drop(static_cast<int>(start->value())));
+}
+
+BUILTIN("sum")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr ints = toIntVector(*argsBegin);
+    return STATIC_CAST(malIntVector, ints)->sum();
+}
+
 BUILTIN("swap!")
 {
     CHECK_ARGS_AT_LEAST(2);
@@ -506,18 +991,65 @@ BUILTIN("time-ms")
     return mal::integer(ms.count());
 }
 
+BUILTIN("transient")
+{
+    CHECK_ARGS_IS(1);
+    malValuePtr arg = *argsBegin;
+
+    if (const malVector* vector = DYNAMIC_CAST(malVector, arg)) {
+        return new malTransientVector(vector->items());
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, arg)) {
+        return new malTransientHash(hash->entries());
+    }
+    if (const malHashSet* set = DYNAMIC_CAST(malHashSet, arg)) {
+        return new malTransientSet(set->entries());
+    }
+    MAL_FAIL("%s can't be made transient", arg->print(true).c_str());
+}
+
+BUILTIN("union")
+{
+    // Add the items of the smaller sets to the largest one.
+    const malSet* largest = NULL;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSet* set = VALUE_CAST(malSet, *it);
+        if (!largest || set->count() > largest->count()) {
+            largest = set;
+        }
+    }
+    if (!largest) {
+        return mal::set(HAMT());
+    }
+
+    malValueVec added;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSet* set = STATIC_CAST(malSet, *it);
+        if (set != largest) {
+            set->forEach([&added](const malValuePtr& item) {
+                added.push_back(item);
+                return true;
+            });
+        }
+    }
+    return largest->conj(added.begin(), added.end());
+}
+
 BUILTIN("vals")
 {
     CHECK_ARGS_IS(1);
-    ARG(malHash, hash);
-    return hash->values();
+    ARG(malMap, map);
+    return map->values();
 }
 
 BUILTIN("vec")
 {
     CHECK_ARGS_IS(1);
+    if (const malIntVector* ints = DYNAMIC_CAST(malIntVector, *argsBegin)) {
+        return mal::vector(STATIC_CAST(malSequence, ints->seq())->items());
+    }
     ARG(malSequence, s);
-    return mal::vector(s->begin(), s->end());
+    return mal::vector(s->items());
 }
 
 BUILTIN("vector")
@@ -536,6 +1068,7 @@ BUILTIN("with-meta")
 void installCore(malEnvPtr env) {
     for (auto it = handlers.begin(), end = handlers.end(); it != end; ++it) {
         malBuiltIn* handler = *it;
+        handler->makeImmortal();
         env->set(handler->name(), handler);
     }
 }
@@ -557,3 +1090,206 @@ static String printValues(malValueIter begin, malValueIter end,
 
     return out;
 }
+
+//  A value which only the argument list refers to can't be seen by anything
+//  else once the builtin returns, so the builtin may update it in place, and
+//  reuse its storage for the result, instead of copying it.
+static bool isUnique(const malValuePtr& value)
+{
+    return value->refCount() == 1;
+}
+
+//  Returns items as a list, reusing seq for it if seq is a list which
+//  nothing else refers to.
+static malValuePtr reuseAsList(const malValuePtr& seq, const RRBVector& items)
+{
+    if (isUnique(seq)) {
+        if (malList* list = DYNAMIC_CAST(malList, seq)) {
+            list->reuse(items);
+            return seq;
+        }
+    }
+    return mal::list(items);
+}
+
+//  Returns coll itself if it's an int-vector, else a sequence of integers
+//  copied into one.
+static malValuePtr toIntVector(const malValuePtr& coll)
+{
+    if (DYNAMIC_CAST(malIntVector, coll)) {
+        return coll;
+    }
+    const malSequence* seq = VALUE_CAST(malSequence, coll);
+    std::unique_ptr<malIntVec> items(new malIntVec);
+    items->reserve(seq->count());
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        items->push_back(VALUE_CAST(malInteger, *it)->value());
+    }
+    return mal::intVector(items.release());
+}
+
+//  The value of an integer, bignum or double, as a double.
+static double toDouble(const malValuePtr& value)
+{
+    if (const malDouble* number = DYNAMIC_CAST(malDouble, value)) {
+        return number->value();
+    }
+    if (const malBigInteger* number = DYNAMIC_CAST(malBigInteger, value)) {
+        return number->value().toDouble();
+    }
+    return VALUE_CAST(malInteger, value)->value();
+}
+
+//  The value of an integer or bignum, as a bignum.
+static BigInteger toBigInteger(const malValuePtr& value)
+{
+    if (const malBigInteger* number = DYNAMIC_CAST(malBigInteger, value)) {
+        return number->value();
+    }
+    return VALUE_CAST(malInteger, value)->value();
+}
+
+//  As addOverflows and the others, counting a zero divisor as overflowing
+//  so that the bignum division reports it.
+static bool divideOverflows(int64_t lhs, int64_t rhs, int64_t& result)
+{
+    if (rhs == 0 || (rhs == -1 && lhs == INT64_MIN)) {
+        return true;
+    }
+    result = lhs / rhs;
+    return false;
+}
+
+//  The item of an int-vector argument to intVectorOp, as a value, or the
+//  argument itself if it's a single number.
+static malValuePtr itemValue(const malIntVector* ints,
+                             const malValuePtr& value, int index)
+{
+    return ints ? mal::integer(ints->item(index)) : value;
+}
+
+//  Returns the int-vector of op applied to each pair of items. Either
+//  argument may be a single number, which pairs with every item; otherwise
+//  the lengths must match. If that's a bignum or a double, or op overflows
+//  on any item, valueOp is applied to each pair instead, and the result is
+//  an int-vector only if each of its items is an integer, and otherwise a
+//  vector.
+template <class Op, class ValueOp>
+static malValuePtr intVectorOp(const malValuePtr& lhs, const malValuePtr& rhs,
+                               Op op, ValueOp valueOp)
+{
+    const malIntVector* lhsInts = DYNAMIC_CAST(malIntVector, lhs);
+    const malIntVector* rhsInts = DYNAMIC_CAST(malIntVector, rhs);
+    int count = lhsInts ? lhsInts->count() : rhsInts->count();
+    MAL_CHECK(!lhsInts || !rhsInts || rhsInts->count() == count,
+              "int-vectors of lengths %d and %d", count, rhsInts->count());
+
+    std::unique_ptr<malIntVec> items(new malIntVec(count));
+    const malInteger* lhsInteger = DYNAMIC_CAST(malInteger, lhs);
+    const malInteger* rhsInteger = DYNAMIC_CAST(malInteger, rhs);
+    if ((lhsInts || lhsInteger) && (rhsInts || rhsInteger)) {
+        int64_t lhsValue = lhsInteger ? lhsInteger->value() : 0;
+        int64_t rhsValue = rhsInteger ? rhsInteger->value() : 0;
+        int64_t* out = items->data();
+        bool overflowed = false;
+        if (lhsInts && rhsInts) {
+            const int64_t* a = lhsInts->items().data();
+            const int64_t* b = rhsInts->items().data();
+            for (int i = 0; i < count; i++) {
+                overflowed |= op(a[i], b[i], out[i]);
+            }
+        }
+        else if (lhsInts) {
+            const int64_t* a = lhsInts->items().data();
+            for (int i = 0; i < count; i++) {
+                overflowed |= op(a[i], rhsValue, out[i]);
+            }
+        }
+        else {
+            const int64_t* b = rhsInts->items().data();
+            for (int i = 0; i < count; i++) {
+                overflowed |= op(lhsValue, b[i], out[i]);
+            }
+        }
+        if (!overflowed) {
+            return mal::intVector(items.release());
+        }
+    }
+
+    std::unique_ptr<malValueVec> values(new malValueVec(count));
+    bool isIntegers = true;
+    for (int i = 0; i < count; i++) {
+        malValuePtr value = valueOp(itemValue(lhsInts, lhs, i),
+                                    itemValue(rhsInts, rhs, i));
+        const malInteger* integer = DYNAMIC_CAST(malInteger, value);
+        isIntegers = isIntegers && integer;
+        (*items)[i] = integer ? integer->value() : 0;
+        (*values)[i] = value;
+    }
+    return isIntegers ? mal::intVector(items.release())
+                      : mal::vector(values.release());
+}
+
+//  Implements (subseq coll test key) and (subseq coll test key test key),
+//  and likewise rsubseq. The tests > and >= bound the range from below, and
+//  < and <= bound it from above. Only the entries in range are visited.
+static malValuePtr sortedRange(const String& name, bool ascending,
+                               malValueIter argsBegin, malValueIter argsEnd)
+{
+    int argCount = CHECK_ARGS_BETWEEN(3, 5);
+    MAL_CHECK(argCount != 4, "%s expects 3 or 5 arguments", name.c_str());
+
+    const AVLTree* entries;
+    const malSortedMap* map = DYNAMIC_CAST(malSortedMap, *argsBegin);
+    if (map) {
+        entries = &map->entries();
+        ++argsBegin;
+    }
+    else {
+        ARG(malSortedSet, set);
+        entries = &set->entries();
+    }
+
+    malValuePtr lower, upper;
+    bool lowerInclusive = false, upperInclusive = false;
+    while (argsBegin != argsEnd) {
+        ARG(malBuiltIn, test);
+        malValuePtr key = *argsBegin++;
+        const String op = test->name();
+        if (op == ">" || op == ">=") {
+            lower = key;
+            lowerInclusive = (op == ">=");
+        }
+        else if (op == "<" || op == "<=") {
+            upper = key;
+            upperInclusive = (op == "<=");
+        }
+        else {
+            MAL_FAIL("%s expects <, <=, > or >= as a test", name.c_str());
+        }
+    }
+
+    const malValuePtr& start = ascending ? lower : upper;
+    const malValuePtr& stop  = ascending ? upper : lower;
+    bool stopInclusive = ascending ? upperInclusive : lowerInclusive;
+
+    AVLTree::Iterator it = !start ? entries->begin(ascending)
+        : entries->from(start, ascending ? lowerInclusive : upperInclusive,
+                        ascending);
+
+    malValueVec items;
+    for (auto end = entries->end(); it != end; ++it) {
+        if (stop) {
+            int order = compareValues(it->key(), stop);
+            if ((ascending ? order > 0 : order < 0) ||
+                (order == 0 && !stopInclusive)) {
+                break;
+            }
+        }
+        items.push_back(map ? mal::vector(it->key(), it->value())
+                            : malValuePtr(it->key()));
+    }
+
+    return items.empty() ? mal::nilValue()
+                         : mal::list(items.begin(), items.end());
+}
@@ -3,65 +3,237 @@
 
 #include <algorithm>
 
-malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+COUNT_LIVE(malScope);
+COUNT_LIVE(malEnv);
+
+unsigned malScope::s_epoch = 0;
+
+malScope::malScope()
+: m_slotCount(0)
+, m_requiredCount(0)
+, m_isVariadic(false)
+, m_isRoot(true)
+, m_isDynamic(false)
 {
-    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    makeAcyclic();
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
-               malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+malScope::malScope(const StringVec& bindings, malScopePtr outer,
+                   bool isParameterList)
+: m_bindings(bindings)
+, m_slotCount(0)
+, m_requiredCount(bindings.size())
+, m_isVariadic(false)
+, m_isRoot(false)
+, m_isDynamic(false)
+, m_outer(outer)
 {
-    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    // Scopes refer only to their outer scopes, so can't form cycles.
+    makeAcyclic();
     int n = bindings.size();
-    auto it = argsBegin;
     for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
+        if (isParameterList && bindings[i] == "&") {
             MAL_CHECK(i == n - 2, "There must be one parameter after the &");
+            m_requiredCount = i;
+            m_isVariadic = true;
+            m_bindingSlots.push_back(-1);
+            continue;
+        }
+        // A name bound twice has the one slot, which the later sets.
+        int slot = slotOf(bindings[i]);
+        m_bindingSlots.push_back(slot >= 0 ? slot : m_slotCount++);
+    }
+}
 
-            set(bindings[n-1], mal::list(it, argsEnd));
-            return;
+int malScope::slotOf(const String& name) const
+{
+    for (int i = 0, n = m_bindingSlots.size(); i < n; i++) {
+        if (m_bindingSlots[i] >= 0 && m_bindings[i] == name) {
+            return m_bindingSlots[i];
         }
+    }
+    return -1;
+}
+
+void malScope::makeDynamic()
+{
+    if (!m_isDynamic) {
+        m_isDynamic = true;
+        s_epoch++;
+    }
+}
+
+void malScope::getChildren(RefCountedVec& children) const
+{
+    children.push_back(m_outer.ptr());
+}
+
+malEnv::malEnv(malEnvPtr outer)
+: m_scope(outer ? NULL : new malScope)
+, m_outer(outer)
+, m_map(NULL)
+, m_slots(m_inline)
+, m_overflow(NULL)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+}
+
+malEnv::malEnv(malEnvPtr outer, malScopePtr scope)
+: m_scope(scope)
+, m_outer(outer)
+, m_map(NULL)
+, m_slots(m_inline)
+, m_overflow(NULL)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    initSlots();
+}
+
+malEnv::malEnv(malEnvPtr outer, malScopePtr scope,
+               malValueIter argsBegin, malValueIter argsEnd)
+: m_scope(scope)
+, m_outer(outer)
+, m_map(NULL)
+, m_slots(m_inline)
+, m_overflow(NULL)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    initSlots();
+    int required = scope->requiredCount();
+    auto it = argsBegin;
+    for (int i = 0; i < required; i++) {
         MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
+        m_slots[scope->bindingSlot(i)] = *it;
         ++it;
     }
+    if (scope->isVariadic()) {
+        m_slots[scope->bindingSlot(required + 1)] = mal::list(it, argsEnd);
+        return;
+    }
     MAL_CHECK(it == argsEnd, "Too many parameters");
 }
 
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    delete m_map;
+    delete m_overflow;
+}
+
+void malEnv::initSlots()
+{
+    int count = m_scope->slotCount();
+    if (count > INLINE_SLOTS) {
+        m_overflow = new malValueVec(count);
+        m_slots = m_overflow->data();
+    }
+}
+
+void malEnv::getChildren(RefCountedVec& children) const
+{
+    if (m_map) {
+        for (auto it = m_map->begin(); it != m_map->end(); ++it) {
+            children.push_back(it->second.ptr());
+        }
+    }
+    int count = m_scope ? m_scope->slotCount() : 0;
+    for (int i = 0; i < count; i++) {
+        children.push_back(m_slots[i].ptr());
+    }
+    children.push_back(m_scope.ptr());
+    children.push_back(m_outer.ptr());
+}
+
+malValuePtr malEnv::extra(const String& symbol) const
+{
+    if (m_map) {
+        auto it = m_map->find(symbol);
+        if (it != m_map->end()) {
+            return it->second;
+        }
+    }
+    return NULL;
+}
+
+malValuePtr* malEnv::cell(const String& symbol) const
+{
+    if (m_map) {
+        auto it = m_map->find(symbol);
+        if (it != m_map->end()) {
+            return &it->second;
+        }
+    }
+    return NULL;
 }
 
 malEnvPtr malEnv::find(const String& symbol)
 {
     for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+        if (env->m_scope) {
+            int slot = env->m_scope->slotOf(symbol);
+            if (slot >= 0 && env->m_slots[slot]) {
+                return env;
+            }
+        }
+        if (env->extra(symbol)) {
             return env;
         }
     }
     return NULL;
 }
 
+malValuePtr malEnv::lookup(const String& symbol)
+{
+    malEnvPtr env = find(symbol);
+    if (!env) {
+        return NULL;
+    }
+    int slot = env->m_scope ? env->m_scope->slotOf(symbol) : -1;
+    return slot >= 0 ? env->m_slots[slot] : env->extra(symbol);
+}
+
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
-        }
+    if (malValuePtr value = lookup(symbol)) {
+        return value;
     }
     MAL_FAIL("'%s' not found", symbol.c_str());
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
-    m_map[symbol] = value;
+    if (m_scope) {
+        int slot = m_scope->slotOf(symbol);
+        if (slot >= 0) {
+            m_slots[slot] = value;
+            return value;
+        }
+        if (!m_scope->isRoot()) {
+            m_scope->makeDynamic();
+        }
+    }
+    if (!m_map) {
+        m_map = new Map;
+    }
+    (*m_map)[symbol] = value;
     return value;
 }
 
+void malEnv::makeBindingsImmortal()
+{
+    if (m_map) {
+        for (auto it = m_map->begin(), end = m_map->end(); it != end; ++it) {
+            it->second->makeImmortal();
+        }
+    }
+    int count = m_scope ? m_scope->slotCount() : 0;
+    for (int i = 0; i < count; i++) {
+        if (m_slots[i]) {
+            m_slots[i]->makeImmortal();
+        }
+    }
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
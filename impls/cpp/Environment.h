@@ -5,11 +5,70 @@
 
 #include <map>
 
-class malEnv : public RefCounted {
+//  What the frames made by one fn*, let* or catch* form bind: their names
+//  in the order the form gives them, each with a slot, and the scope of
+//  the frames they're made in. A global environment has a root scope of
+//  its own, which binds nothing in slots.
+//
+//  Every frame of a scope is made in a frame of its outer scope, so from a
+//  frame of a given scope a name is always found in the same slot the same
+//  number of frames out, and a symbol need only look that up once. The one
+//  exception is a def! in a frame of a name that its scope doesn't bind,
+//  which goes into the frame's map of extra bindings: that scope becomes
+//  dynamic, and the names looked through it are looked up again.
+
+class malScope : public Counted<malScope, RefCounted> {
 public:
+    malScope();
+    // In a parameter list, the name after an & takes the rest of the
+    // arguments, and the & has no slot.
+    malScope(const StringVec& bindings, malScopePtr outer,
+             bool isParameterList = false);
+
+    int bindingCount() const { return m_bindings.size(); }
+    const String& binding(int i) const { return m_bindings[i]; }
+    int bindingSlot(int i) const { return m_bindingSlots[i]; }
+
+    int slotCount() const { return m_slotCount; }
+    // Returns -1 if the name isn't bound in a slot.
+    int slotOf(const String& name) const;
+
+    // Those of a parameter list.
+    int requiredCount() const { return m_requiredCount; }
+    bool isVariadic() const { return m_isVariadic; }
+
+    malScope* outer() const { return m_outer.ptr(); }
+    bool isRoot() const { return m_isRoot; }
+
+    bool isDynamic() const { return m_isDynamic; }
+    void makeDynamic();
+
+    // Changes whenever a scope becomes dynamic.
+    static unsigned epoch() { return s_epoch; }
+
+    virtual void getChildren(RefCountedVec& children) const;
+
+private:
+    StringVec        m_bindings;
+    std::vector<int> m_bindingSlots;
+    int              m_slotCount;
+    int              m_requiredCount;
+    bool             m_isVariadic;
+    bool             m_isRoot;
+    bool             m_isDynamic;
+    const malScopePtr m_outer;
+
+    static unsigned s_epoch;
+};
+
+class malEnv : public Counted<malEnv, RefCounted> {
+public:
+    // Without an outer frame, that of a global environment; otherwise a
+    // frame with no scope, which binds everything in its map.
     malEnv(malEnvPtr outer = NULL);
-    malEnv(malEnvPtr outer,
-           const StringVec& bindings,
+    malEnv(malEnvPtr outer, malScopePtr scope);
+    // Binds the arguments to the scope's parameter list.
+    malEnv(malEnvPtr outer, malScopePtr scope,
            malValueIter argsBegin,
            malValueIter argsEnd);
 
@@ -20,10 +79,53 @@ public:
     malValuePtr set(const String& symbol, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // Returns NULL if the symbol isn't bound.
+    malValuePtr lookup(const String& symbol);
+
+    malScope* scope() const { return m_scope.ptr(); }
+    malEnv* outer() const { return m_outer.ptr(); }
+
+    // Empty until the binding for it has been evaluated.
+    const malValuePtr& slot(int i) const { return m_slots[i]; }
+    void setSlot(int i, malValuePtr value) { m_slots[i] = value; }
+
+    // Returns NULL if the symbol isn't in this frame's map.
+    malValuePtr extra(const String& symbol) const;
+
+    // The cell in this frame's map for symbol, or NULL if it has none.
+    // Every def! of it here sets that same cell, so symbols hold on to
+    // those of the global frame, for as long as it lives.
+    malValuePtr* cell(const String& symbol) const;
+
+    // Makes the values bound so far immortal, for those installed at
+    // startup, which live as long as the program anyway.
+    void makeBindingsImmortal();
+
+    virtual void getChildren(RefCountedVec& children) const;
+
+#ifdef MAL_TRACING_GC
+    virtual const void* ownedBuffer() const {
+        return m_overflow ? m_overflow->data() : NULL;
+    }
+#endif
+
 private:
+    void initSlots();
+
     typedef std::map<String, malValuePtr> Map;
-    Map m_map;
-    malEnvPtr m_outer;
+
+    // Slots for the bindings of a call or a let*, which nearly always fit
+    // here, so that making the frame is the one allocation. The allocator
+    // frees objects by the size of their class, so this can't vary.
+    static const int INLINE_SLOTS = 4;
+
+    const malScopePtr m_scope;
+    malEnvPtr         m_outer;
+    Map*              m_map;      // NULL until a binding needs it; its
+                                  // nodes, so its values, never move
+    malValuePtr*      m_slots;    // m_inline, or m_overflow's
+    malValueVec*      m_overflow; // NULL unless the slots don't fit inline
+    malValuePtr       m_inline[INLINE_SLOTS];
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
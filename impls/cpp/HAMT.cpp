@@ -0,0 +1,341 @@
+#include "HAMT.h"
+#include "Types.h"
+
+#define HAMT_BITS       5
+#define HAMT_MASK       ((1 << HAMT_BITS) - 1)
+#define HAMT_HASH_BITS  32  // beyond this, colliding keys share one node
+
+typedef HAMT::Entry     Entry;
+typedef HAMTNode::EntryVec EntryVec;
+typedef HAMTNode::NodeVec  NodeVec;
+
+COUNT_LIVE(HAMTNode);
+
+static uint32_t hashOf(const HAMT::Key& key)
+{
+    return key->hash();
+}
+
+static bool isEqual(const malValue* a, const malValue* b)
+{
+    return a == b || a->isEqualTo(b);
+}
+
+static bool sameKey(const Entry& entry, uint32_t hash, const HAMT::Key& key)
+{
+    return entry.hash == hash && isEqual(entry.key.ptr(), key.ptr());
+}
+
+static uint32_t bitFor(uint32_t hash, int shift)
+{
+    return 1u << ((hash >> shift) & HAMT_MASK);
+}
+
+// The position of bit's slot amongst the occupied slots of bitmap.
+static int indexOf(uint32_t bitmap, uint32_t bit)
+{
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+static HAMTNodePtr makeNode(uint32_t dataMap, uint32_t nodeMap,
+                            EntryVec& entries, NodeVec& children,
+                            malOwner owner)
+{
+    return HAMTNodePtr(new HAMTNode(dataMap, nodeMap, entries, children,
+                                    owner));
+}
+
+//  Returns a node which may be updated in place: the node itself if owner
+//  owns it or it isn't shared with any other trie, otherwise a copy owned by
+//  owner, which replaces it. The copy has room for one more entry or child.
+static HAMTNode* editable(HAMTNodePtr& node, malOwner owner, bool unique)
+{
+    if (!unique && (owner == NO_OWNER || node->owner() != owner)) {
+        EntryVec entries;
+        entries.reserve(node->entries().size() + 1);
+        entries.assign(node->entries().begin(), node->entries().end());
+        NodeVec children;
+        children.reserve(node->children().size() + 1);
+        children.assign(node->children().begin(), node->children().end());
+        node = makeNode(node->dataMap(), node->nodeMap(),
+                        entries, children, owner);
+    }
+    return node.ptr();
+}
+
+static bool isSingleton(const HAMTNodePtr& node)
+{
+    return node->entries().size() == 1 && node->children().empty();
+}
+
+// Builds the smallest sub-trie holding two entries with different keys.
+static HAMTNodePtr mergeEntries(const Entry& a, const Entry& b, int shift,
+                                malOwner owner)
+{
+    EntryVec entries;
+    NodeVec children;
+    if (shift >= HAMT_HASH_BITS) {
+        entries.push_back(a);
+        entries.push_back(b);
+        return makeNode(0, 0, entries, children, owner);
+    }
+
+    uint32_t aBit = bitFor(a.hash, shift);
+    uint32_t bBit = bitFor(b.hash, shift);
+    if (aBit == bBit) {
+        children.push_back(mergeEntries(a, b, shift + HAMT_BITS, owner));
+        return makeNode(0, aBit, entries, children, owner);
+    }
+    entries.push_back(aBit < bBit ? a : b);
+    entries.push_back(aBit < bBit ? b : a);
+    return makeNode(aBit | bBit, 0, entries, children, owner);
+}
+
+//  The updates below take unique to say whether every node above this one is
+//  unique, and so whether it can be if nothing else refers to it.
+
+//  Returns the node with the entry added, which is the node itself if it was
+//  already present or the node could be updated in place.
+static HAMTNodePtr assocIn(const HAMTNodePtr& node, int shift,
+                           const Entry& entry, malOwner owner, bool unique,
+                           bool& added)
+{
+    unique = unique && node->refCount() == 1;
+    HAMTNodePtr result = node;
+
+    if (shift >= HAMT_HASH_BITS) {
+        const EntryVec& entries = node->entries();
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (isEqual(entries[i].key.ptr(), entry.key.ptr())) {
+                if (entries[i].value != entry.value) {
+                    HAMTNode* edit = editable(result, owner, unique);
+                    edit->mutableEntries()[i].value = entry.value;
+                }
+                return result;
+            }
+        }
+        added = true;
+        editable(result, owner, unique)->mutableEntries().push_back(entry);
+        return result;
+    }
+
+    uint32_t dataMap = node->dataMap();
+    uint32_t nodeMap = node->nodeMap();
+    uint32_t bit = bitFor(entry.hash, shift);
+
+    if (dataMap & bit) {
+        int index = indexOf(dataMap, bit);
+        const Entry& existing = node->entries()[index];
+        if (sameKey(existing, entry.hash, entry.key)) {
+            if (existing.value != entry.value) {
+                HAMTNode* edit = editable(result, owner, unique);
+                edit->mutableEntries()[index].value = entry.value;
+            }
+            return result;
+        }
+
+        // Push both entries down into a new sub-trie.
+        added = true;
+        HAMTNodePtr child = mergeEntries(existing, entry, shift + HAMT_BITS,
+                                         owner);
+        HAMTNode* edit = editable(result, owner, unique);
+        edit->mutableEntries().erase(edit->mutableEntries().begin() + index);
+        edit->mutableChildren().insert(
+            edit->mutableChildren().begin() + indexOf(nodeMap, bit), child);
+        edit->setMaps(dataMap & ~bit, nodeMap | bit);
+        return result;
+    }
+
+    if (nodeMap & bit) {
+        int index = indexOf(nodeMap, bit);
+        const HAMTNodePtr& oldChild = node->children()[index];
+        HAMTNodePtr child = assocIn(oldChild, shift + HAMT_BITS, entry,
+                                    owner, unique, added);
+        if (child != oldChild) {
+            HAMTNode* edit = editable(result, owner, unique);
+            edit->mutableChildren()[index] = child;
+        }
+        return result;
+    }
+
+    added = true;
+    HAMTNode* edit = editable(result, owner, unique);
+    edit->mutableEntries().insert(
+        edit->mutableEntries().begin() + indexOf(dataMap, bit), entry);
+    edit->setMaps(dataMap | bit, nodeMap);
+    return result;
+}
+
+//  Returns the node without the key, or NULL if that leaves it empty. Any
+//  sub-trie which shrinks to a single entry is pulled up into its parent,
+//  so that every map has a single canonical shape.
+static HAMTNodePtr dissocIn(const HAMTNodePtr& node, int shift,
+                            uint32_t hash, const HAMT::Key& key,
+                            malOwner owner, bool unique, bool& removed)
+{
+    unique = unique && node->refCount() == 1;
+    const EntryVec& entries = node->entries();
+    const NodeVec& children = node->children();
+    HAMTNodePtr result = node;
+
+    if (shift >= HAMT_HASH_BITS) {
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (isEqual(entries[i].key.ptr(), key.ptr())) {
+                removed = true;
+                if (entries.size() == 1) {
+                    return NULL;
+                }
+                HAMTNode* edit = editable(result, owner, unique);
+                edit->mutableEntries().erase(
+                    edit->mutableEntries().begin() + i);
+                return result;
+            }
+        }
+        return result;
+    }
+
+    uint32_t dataMap = node->dataMap();
+    uint32_t nodeMap = node->nodeMap();
+    uint32_t bit = bitFor(hash, shift);
+
+    if (dataMap & bit) {
+        int index = indexOf(dataMap, bit);
+        if (!sameKey(entries[index], hash, key)) {
+            return result;
+        }
+        removed = true;
+        if (isSingleton(node)) {
+            return NULL;
+        }
+        HAMTNode* edit = editable(result, owner, unique);
+        edit->mutableEntries().erase(edit->mutableEntries().begin() + index);
+        edit->setMaps(dataMap & ~bit, nodeMap);
+        return result;
+    }
+
+    if (nodeMap & bit) {
+        int index = indexOf(nodeMap, bit);
+        HAMTNodePtr child = dissocIn(children[index], shift + HAMT_BITS,
+                                     hash, key, owner, unique, removed);
+        if (!removed) {
+            return result;
+        }
+
+        if (child && !isSingleton(child)) {
+            if (child != children[index]) {
+                HAMTNode* edit = editable(result, owner, unique);
+                edit->mutableChildren()[index] = child;
+            }
+            return result;
+        }
+
+        HAMTNode* edit = editable(result, owner, unique);
+        edit->mutableChildren().erase(edit->mutableChildren().begin() + index);
+        nodeMap &= ~bit;
+        if (child) {
+            edit->mutableEntries().insert(
+                edit->mutableEntries().begin() + indexOf(dataMap, bit),
+                child->entries()[0]);
+            dataMap |= bit;
+        }
+        if (edit->entries().empty() && edit->children().empty()) {
+            return NULL;
+        }
+        edit->setMaps(dataMap, nodeMap);
+        return result;
+    }
+
+    return result;
+}
+
+void HAMTNode::getChildren(RefCountedVec& children) const
+{
+    for (auto it = m_entries.begin(); it != m_entries.end(); ++it) {
+        children.push_back(it->key.ptr());
+        children.push_back(it->value.ptr());
+    }
+    for (auto it = m_children.begin(); it != m_children.end(); ++it) {
+        children.push_back(it->ptr());
+    }
+}
+
+HAMT::HAMT()
+: m_count(0)
+{
+
+}
+
+void HAMT::getChildren(RefCountedVec& children) const
+{
+    children.push_back(m_root.ptr());
+}
+
+const malValueRef* HAMT::find(const Key& key) const
+{
+    uint32_t hash = hashOf(key);
+    const HAMTNode* node = m_root.ptr();
+    for (int shift = 0; node != NULL; shift += HAMT_BITS) {
+        if (shift >= HAMT_HASH_BITS) {
+            for (auto it = node->entries().begin();
+                 it != node->entries().end(); ++it) {
+                if (isEqual(it->key.ptr(), key.ptr())) {
+                    return &it->value;
+                }
+            }
+            return NULL;
+        }
+
+        uint32_t bit = bitFor(hash, shift);
+        if (node->dataMap() & bit) {
+            const Entry& entry =
+                node->entries()[indexOf(node->dataMap(), bit)];
+            return sameKey(entry, hash, key) ? &entry.value : NULL;
+        }
+        if (!(node->nodeMap() & bit)) {
+            return NULL;
+        }
+        node = node->children()[indexOf(node->nodeMap(), bit)].ptr();
+    }
+    return NULL;
+}
+
+HAMT HAMT::assoc(const Key& key, malValuePtr value) const
+{
+    HAMT result = *this;
+    result.assocInPlace(key, value);
+    return result;
+}
+
+HAMT HAMT::dissoc(const Key& key) const
+{
+    HAMT result = *this;
+    result.dissocInPlace(key);
+    return result;
+}
+
+void HAMT::assocInPlace(const Key& key, malValuePtr value, malOwner owner)
+{
+    Entry entry = { hashOf(key), key, value };
+    if (!m_root) {
+        EntryVec entries(1, entry);
+        NodeVec children;
+        m_root = makeNode(bitFor(entry.hash, 0), 0, entries, children, owner);
+        m_count = 1;
+        return;
+    }
+
+    bool added = false;
+    m_root = assocIn(m_root, 0, entry, owner, true, added);
+    m_count += added ? 1 : 0;
+}
+
+void HAMT::dissocInPlace(const Key& key, malOwner owner)
+{
+    if (!m_root) {
+        return;
+    }
+
+    bool removed = false;
+    m_root = dissocIn(m_root, 0, hashOf(key), key, owner, true, removed);
+    m_count -= removed ? 1 : 0;
+}
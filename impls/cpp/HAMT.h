@@ -0,0 +1,181 @@
+#ifndef INCLUDE_HAMT_H
+#define INCLUDE_HAMT_H
+
+#include "MAL.h"
+
+#include <stdint.h>
+
+//  A persistent hash array mapped trie, in the compressed (CHAMP) layout.
+//
+//  Each node consumes 5 bits of the key's hash and keeps two bitmaps, one
+//  marking the slots holding entries inline and one marking the slots holding
+//  sub-tries. Only the occupied slots are stored. Updates copy the nodes on
+//  the path to the key and share every other sub-trie with the original, so
+//  assoc, dissoc and lookup are all O(log32 n).
+//
+//  Keys may be any value. They are hashed with malValue::hash and compared
+//  with malValue::isEqualTo, so lookups neither allocate nor print.
+//
+//  HAMT is a small value type; copying it shares the whole trie. It can also
+//  be updated in place, through the InPlace operations. These copy only the
+//  nodes which are shared with some other trie, and which owner hasn't
+//  already copied; owner is the transient doing the update, if there is one.
+
+class HAMTNode;
+typedef RefCountedPtr<HAMTNode> HAMTNodePtr;
+
+class HAMT {
+public:
+    typedef malValuePtr Key;
+
+    struct Entry {
+        uint32_t    hash;
+        malValueRef key;
+        malValueRef value;
+    };
+
+    class Iterator;
+
+    HAMT();
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+
+    // Returns NULL if the key isn't present.
+    const malValueRef* find(const Key& key) const;
+
+    HAMT assoc(const Key& key, malValuePtr value) const;
+    HAMT dissoc(const Key& key) const;
+
+    void assocInPlace(const Key& key, malValuePtr value,
+                      malOwner owner = NO_OWNER);
+    void dissocInPlace(const Key& key, malOwner owner = NO_OWNER);
+
+    Iterator begin() const;
+    Iterator end() const;
+
+    void getChildren(RefCountedVec& children) const;
+
+private:
+    HAMT(HAMTNodePtr root, int count) : m_root(root), m_count(count) { }
+
+    HAMTNodePtr m_root;
+    int         m_count;
+};
+
+class HAMTNode : public Counted<HAMTNode, RefCounted> {
+public:
+    typedef std::vector<HAMT::Entry> EntryVec;
+    typedef std::vector<HAMTNodePtr> NodeVec;
+
+    HAMTNode(uint32_t dataMap, uint32_t nodeMap,
+             EntryVec& entries, NodeVec& children, malOwner owner)
+    : m_dataMap(dataMap), m_nodeMap(nodeMap), m_owner(owner) {
+        m_entries.swap(entries);
+        m_children.swap(children);
+    }
+
+    uint32_t dataMap() const { return m_dataMap; }
+    uint32_t nodeMap() const { return m_nodeMap; }
+    malOwner owner() const { return m_owner; }
+    const EntryVec& entries() const { return m_entries; }
+    const NodeVec& children() const { return m_children; }
+
+    virtual void getChildren(RefCountedVec& children) const;
+
+    // Only for nodes which are not shared.
+    void setMaps(uint32_t dataMap, uint32_t nodeMap) {
+        m_dataMap = dataMap;
+        m_nodeMap = nodeMap;
+    }
+    EntryVec& mutableEntries() { return m_entries; }
+    NodeVec& mutableChildren() { return m_children; }
+
+private:
+    uint32_t        m_dataMap;
+    uint32_t        m_nodeMap;
+    const malOwner  m_owner;
+    EntryVec        m_entries;
+    NodeVec         m_children;
+};
+
+class HAMT::Iterator {
+public:
+    Iterator(const HAMTNode* root) : m_depth(-1) {
+        if (root) {
+            push(root);
+            settle();
+        }
+    }
+
+    const Entry& operator * () const { return current(); }
+    const Entry* operator -> () const { return &current(); }
+
+    Iterator& operator ++ () {
+        m_stack[m_depth].entry++;
+        settle();
+        return *this;
+    }
+
+    bool operator != (const Iterator& that) const {
+        return !(*this == that);
+    }
+
+    bool operator == (const Iterator& that) const {
+        if (m_depth != that.m_depth) {
+            return false;
+        }
+        return m_depth < 0 ||
+            (m_stack[m_depth].node  == that.m_stack[m_depth].node &&
+             m_stack[m_depth].entry == that.m_stack[m_depth].entry);
+    }
+
+private:
+    const Entry& current() const {
+        return m_stack[m_depth].node->entries()[m_stack[m_depth].entry];
+    }
+
+    void push(const HAMTNode* node) {
+        Frame& frame = m_stack[++m_depth];
+        frame.node  = node;
+        frame.entry = 0;
+        frame.child = 0;
+    }
+
+    // Moves forward until we're on an entry, or have run off the end.
+    void settle() {
+        while (m_depth >= 0) {
+            Frame& frame = m_stack[m_depth];
+            if (frame.entry < (int)frame.node->entries().size()) {
+                return;
+            }
+            if (frame.child < (int)frame.node->children().size()) {
+                push(frame.node->children()[frame.child++].ptr());
+            }
+            else {
+                m_depth--;
+            }
+        }
+    }
+
+    struct Frame {
+        const HAMTNode* node;
+        int             entry;
+        int             child;
+    };
+
+    Frame   m_stack[8]; // 32 hash bits in 5 bit steps, plus collisions
+    int     m_depth;
+};
+
+inline HAMT::Iterator HAMT::begin() const
+{
+    return Iterator(m_root.ptr());
+}
+
+inline HAMT::Iterator HAMT::end() const
+{
+    return Iterator(NULL);
+}
+
+#endif // INCLUDE_HAMT_H
@@ -1,21 +1,57 @@
 #ifndef INCLUDE_MAL_H
 #define INCLUDE_MAL_H
 
+#include "CompressedPtr.h"
 #include "Debug.h"
 #include "RefCountedPtr.h"
 #include "String.h"
 #include "Validation.h"
 
+#include <stdint.h>
 #include <vector>
 
 class malValue;
 typedef RefCountedPtr<malValue>  malValuePtr;
-typedef std::vector<malValuePtr> malValueVec;
+typedef std::vector<malValuePtr, BufferAllocator<malValuePtr> > malValueVec;
 typedef malValueVec::iterator    malValueIter;
 
+// What the persistent collections hold their items in.
+#ifdef MAL_COMPRESSED_REFS
+#ifdef MAL_TRACING_GC
+#error Compressed references need the reference counted heap
+#endif
+typedef CompressedPtr<malValue>  malValueRef;
+typedef std::vector<malValueRef, BufferAllocator<malValueRef> >
+                                 malValueRefVec;
+#else
+typedef malValuePtr              malValueRef;
+typedef malValueVec              malValueRefVec;
+#endif
+
+// Empties items into refs: just a swap, unless references are compressed.
+inline void moveItems(malValueVec& items, malValueRefVec& refs)
+{
+#ifdef MAL_COMPRESSED_REFS
+    refs.assign(items.begin(), items.end());
+    items.clear();
+#else
+    refs.swap(items);
+#endif
+}
+typedef std::vector<int64_t>     malIntVec;
+
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+class malScope;
+typedef RefCountedPtr<malScope>   malScopePtr;
+
+// Nodes of the persistent collections are tagged with the transient which
+// created them, if any, so that it alone may update them in place. Untagged
+// nodes may be shared, and are always copied to update them.
+typedef uint32_t malOwner;
+const malOwner NO_OWNER = 0;
+
 // step*.cpp
 extern malValuePtr APPLY(malValuePtr op,
                          malValueIter argsBegin, malValueIter argsEnd);
@@ -29,4 +65,7 @@ extern void installCore(malEnvPtr env);
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
 
+// Types.cpp
+extern malOwner newOwner();
+
 #endif // INCLUDE_MAL_H
@@ -0,0 +1,371 @@
+#ifdef MAL_TRACING_GC
+
+#include "RefCountedPtr.h"
+#include "PointerSet.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+//  The tracing collector, built instead of the cycle collector when
+//  MAL_TRACING_GC is defined.
+//
+//  The heap is traced precisely, through getChildren, but what refers to it
+//  from outside is found conservatively: any word on the C++ stack, or in
+//  the buffer of a value vector which no object owns, that holds the address
+//  of an object keeps it alive. Only the evaluator's safe point and
+//  collect-cycles start a collection, and neither is reached with the only
+//  pointer to an object kept anywhere else, such as in a temporary vector
+//  of tree nodes.
+
+//  Linux only: where glibc says the main thread's stack begins.
+extern "C" void* __libc_stack_end;
+
+//  Objects and buffers of up to LARGEST_CELL bytes are carved from chunks,
+//  each of cells of a single size, and each aligned to its size so that the
+//  chunk an address is in is found by masking it. Freed cells go on a free
+//  list for their size; chunks are never given back.
+static const size_t CHUNK_SIZE = 64 << 10;
+static const size_t CELL_ALIGN = 16;
+static const size_t LARGEST_CELL = 256;
+static const size_t SIZE_CLASSES = LARGEST_CELL / CELL_ALIGN + 1;
+
+struct Chunk {
+    size_t cellSize;
+    size_t cellCount;
+    bool holdsBuffers;
+    bool allocated[CHUNK_SIZE / CELL_ALIGN];
+
+    char* cells() { return reinterpret_cast<char*>(this) + CELLS_OFFSET; }
+
+    static const size_t CELLS_OFFSET;
+};
+
+const size_t Chunk::CELLS_OFFSET =
+    (sizeof(Chunk) + CELL_ALIGN - 1) & ~(CELL_ALIGN - 1);
+
+//  A buffer is preceded by its size, and by whether an object owned it at
+//  the start of the current collection.
+struct BufferHeader {
+    size_t size;
+    size_t isOwned;
+};
+
+//  All plain data, for the same reason as in RefCountedPtr.cpp.
+static PointerSet chunks;
+static PointerSet largeObjects;
+static PointerSet largeBuffers;
+static void* freeCells[2][SIZE_CLASSES]; // by holdsBuffers, then size class
+
+static Chunk* chunkOf(const void* p)
+{
+    return reinterpret_cast<Chunk*>(
+        reinterpret_cast<uintptr_t>(p) & ~(CHUNK_SIZE - 1));
+}
+
+static size_t cellIndex(Chunk* chunk, const void* p)
+{
+    return (static_cast<const char*>(p) - chunk->cells()) / chunk->cellSize;
+}
+
+static void addChunk(size_t sizeClass, bool holdsBuffers)
+{
+    void* memory;
+    if (posix_memalign(&memory, CHUNK_SIZE, CHUNK_SIZE) != 0) {
+        throw std::bad_alloc();
+    }
+    Chunk* chunk = static_cast<Chunk*>(memory);
+    memset(chunk, 0, sizeof(Chunk));
+    chunk->cellSize = sizeClass * CELL_ALIGN;
+    chunk->cellCount = (CHUNK_SIZE - Chunk::CELLS_OFFSET) / chunk->cellSize;
+    chunk->holdsBuffers = holdsBuffers;
+    chunks.insert(chunk);
+
+    // Pushed last to first, so they're handed out in address order.
+    void*& head = freeCells[holdsBuffers][sizeClass];
+    for (size_t i = chunk->cellCount; i-- > 0; ) {
+        void* cell = chunk->cells() + i * chunk->cellSize;
+        *static_cast<void**>(cell) = head;
+        head = cell;
+    }
+}
+
+static void* allocateCell(size_t size, bool holdsBuffers)
+{
+    size_t sizeClass = (size + CELL_ALIGN - 1) / CELL_ALIGN;
+    if (sizeClass == 0) {
+        sizeClass = 1;
+    }
+    void*& head = freeCells[holdsBuffers][sizeClass];
+    if (head == NULL) {
+        addChunk(sizeClass, holdsBuffers);
+    }
+    void* cell = head;
+    head = *static_cast<void**>(cell);
+
+    Chunk* chunk = chunkOf(cell);
+    chunk->allocated[cellIndex(chunk, cell)] = true;
+    return cell;
+}
+
+static void freeCell(void* cell)
+{
+    Chunk* chunk = chunkOf(cell);
+    chunk->allocated[cellIndex(chunk, cell)] = false;
+    void*& head = freeCells[chunk->holdsBuffers][chunk->cellSize / CELL_ALIGN];
+    *static_cast<void**>(cell) = head;
+    head = cell;
+}
+
+void* RefCounted::operator new(size_t size)
+{
+    chargeBudget(size);
+    s_allocatedBytes += size;
+    s_allocatedSinceCollection += size;
+    if (size <= LARGEST_CELL) {
+        return allocateCell(size, false);
+    }
+    void* object = ::operator new(size);
+    largeObjects.insert(object);
+    return object;
+}
+
+void RefCounted::operator delete(void* object, size_t size)
+{
+    s_freedBytes += size;
+    if (size <= LARGEST_CELL) {
+        freeCell(object);
+        return;
+    }
+    largeObjects.remove(object);
+    ::operator delete(object);
+}
+
+void* RefCounted::allocateBuffer(size_t size)
+{
+    s_allocatedSinceCollection += size;
+    size_t total = sizeof(BufferHeader) + size;
+    BufferHeader* header;
+    if (total <= LARGEST_CELL) {
+        header = static_cast<BufferHeader*>(allocateCell(total, true));
+    }
+    else {
+        header = static_cast<BufferHeader*>(malloc(total));
+        if (header == NULL) {
+            throw std::bad_alloc();
+        }
+        largeBuffers.insert(header);
+    }
+    header->size = size;
+    header->isOwned = false;
+    return header + 1;
+}
+
+void RefCounted::freeBuffer(void* buffer)
+{
+    if (buffer == NULL) {
+        return;
+    }
+    BufferHeader* header = static_cast<BufferHeader*>(buffer) - 1;
+    if (sizeof(BufferHeader) + header->size <= LARGEST_CELL) {
+        freeCell(header);
+        return;
+    }
+    largeBuffers.remove(header);
+    free(header);
+}
+
+class MarkSweep {
+public:
+    size_t collect();
+
+private:
+    static bool isMarked(const RefCounted* object) {
+        return (object->m_word & RefCounted::MARKED) != 0;
+    }
+
+    // Calls f on every object, or on the header of every buffer.
+    template<class F> static void forEachObject(F f);
+    template<class F> static void forEachBuffer(F f);
+
+    // Returns the object starting at p, if there is one.
+    static const RefCounted* objectAt(const void* p);
+
+    void mark(const RefCounted* object);
+    void scan(const void* begin, const void* end);
+    void scanStack();
+    void scanAbove();
+    void trace();
+
+    RefCountedVec m_stack;
+    RefCountedVec m_children;
+};
+
+template<class F> void MarkSweep::forEachObject(F f)
+{
+    for (size_t i = 0; i < chunks.capacity; i++) {
+        Chunk* chunk = const_cast<Chunk*>(
+            static_cast<const Chunk*>(chunks.slots[i]));
+        if (chunk == NULL || chunk->holdsBuffers) {
+            continue;
+        }
+        for (size_t j = 0; j < chunk->cellCount; j++) {
+            if (chunk->allocated[j]) {
+                f(reinterpret_cast<const RefCounted*>(
+                    chunk->cells() + j * chunk->cellSize));
+            }
+        }
+    }
+    for (size_t i = 0; i < largeObjects.capacity; i++) {
+        if (largeObjects.slots[i] != NULL) {
+            f(static_cast<const RefCounted*>(largeObjects.slots[i]));
+        }
+    }
+}
+
+template<class F> void MarkSweep::forEachBuffer(F f)
+{
+    for (size_t i = 0; i < chunks.capacity; i++) {
+        Chunk* chunk = const_cast<Chunk*>(
+            static_cast<const Chunk*>(chunks.slots[i]));
+        if (chunk == NULL || !chunk->holdsBuffers) {
+            continue;
+        }
+        for (size_t j = 0; j < chunk->cellCount; j++) {
+            if (chunk->allocated[j]) {
+                f(reinterpret_cast<BufferHeader*>(
+                    chunk->cells() + j * chunk->cellSize));
+            }
+        }
+    }
+    for (size_t i = 0; i < largeBuffers.capacity; i++) {
+        if (largeBuffers.slots[i] != NULL) {
+            f(const_cast<BufferHeader*>(
+                static_cast<const BufferHeader*>(largeBuffers.slots[i])));
+        }
+    }
+}
+
+const RefCounted* MarkSweep::objectAt(const void* p)
+{
+    Chunk* chunk = chunkOf(p);
+    if (!chunks.contains(chunk)) {
+        return largeObjects.contains(p)
+            ? static_cast<const RefCounted*>(p) : NULL;
+    }
+    const char* cells = chunk->cells();
+    const char* address = static_cast<const char*>(p);
+    if (chunk->holdsBuffers || address < cells
+            || (address - cells) % chunk->cellSize != 0) {
+        return NULL;
+    }
+    size_t index = cellIndex(chunk, p);
+    if (index >= chunk->cellCount || !chunk->allocated[index]) {
+        return NULL;
+    }
+    return static_cast<const RefCounted*>(p);
+}
+
+void MarkSweep::mark(const RefCounted* object)
+{
+    if (object != NULL && !isMarked(object)) {
+        object->m_word |= RefCounted::MARKED;
+        m_stack.push_back(object);
+    }
+}
+
+// The stack is read whole, including what the address sanitizer poisons.
+#if defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+__attribute__((no_sanitize_address))
+#  endif
+#elif defined(__SANITIZE_ADDRESS__)
+__attribute__((no_sanitize_address))
+#endif
+void MarkSweep::scan(const void* begin, const void* end)
+{
+    for (const void* const* word = static_cast<const void* const*>(begin);
+         word < end; ++word) {
+        mark(objectAt(*word));
+    }
+}
+
+// The registers of its callers are spilled into scanStack's frame, which is
+// then scanned, along with the rest of the stack, from scanAbove's frame.
+__attribute__((noinline)) void MarkSweep::scanStack()
+{
+    __builtin_unwind_init();
+    scanAbove();
+    // Keeps the call from being made a jump, which would drop the frame.
+    __asm__ __volatile__("" : : : "memory");
+}
+
+__attribute__((noinline)) void MarkSweep::scanAbove()
+{
+    scan(__builtin_frame_address(0), __libc_stack_end);
+}
+
+void MarkSweep::trace()
+{
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        m_children.clear();
+        object->getChildren(m_children);
+        for (size_t i = 0; i < m_children.size(); i++) {
+            mark(m_children[i]);
+        }
+    }
+}
+
+size_t MarkSweep::collect()
+{
+    // The buffers which objects own are traced through getChildren; the
+    // rest belong to temporaries, and are roots.
+    forEachObject([this](const RefCounted* object) {
+        if (object->isImmortal()) {
+            mark(object);
+        }
+        const void* buffer = object->ownedBuffer();
+        if (buffer != NULL) {
+            (static_cast<BufferHeader*>(const_cast<void*>(buffer)) - 1)
+                ->isOwned = true;
+        }
+    });
+    forEachBuffer([this](BufferHeader* header) {
+        if (header->isOwned) {
+            header->isOwned = false;
+        }
+        else {
+            const char* buffer = reinterpret_cast<const char*>(header + 1);
+            scan(buffer, buffer + header->size);
+        }
+    });
+    scanStack();
+    trace();
+
+    RefCountedVec garbage;
+    forEachObject([&garbage](const RefCounted* object) {
+        if (isMarked(object)) {
+            object->m_word &= ~RefCounted::MARKED;
+        }
+        else {
+            garbage.push_back(object);
+        }
+    });
+
+    // Nothing is counted, so deleting an object frees nothing else.
+    size_t freedBefore = RefCounted::freedBytes();
+    for (size_t i = 0; i < garbage.size(); i++) {
+        delete garbage[i];
+    }
+    return RefCounted::freedBytes() - freedBefore;
+}
+
+size_t RefCounted::runCollector()
+{
+    MarkSweep collector;
+    return collector.collect();
+}
+
+#endif // MAL_TRACING_GC
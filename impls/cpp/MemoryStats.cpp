@@ -0,0 +1,107 @@
+#include "MemoryStats.h"
+
+#include <signal.h>
+#include <unistd.h>
+
+LiveCount LiveCount::valueBuffers = { "malValueVec", 0, 0, NULL };
+
+static LiveCount* firstCount = &LiveCount::valueBuffers;
+
+LiveCountName::LiveCountName(LiveCount& count, const char* name)
+{
+    count.name = name;
+    count.next = firstCount;
+    firstCount = &count;
+}
+
+const LiveCount* LiveCount::first()
+{
+    return firstCount;
+}
+
+//  Formatting by hand, into a buffer on the stack, as neither snprintf nor
+//  anything which might allocate is safe to call from a signal handler.
+class DumpLine {
+public:
+    DumpLine() : m_length(0) { }
+
+    void append(const char* text, size_t width = 0) {
+        size_t start = m_length;
+        while (*text != '\0' && m_length < sizeof m_text) {
+            m_text[m_length++] = *text++;
+        }
+        pad(start, width);
+    }
+
+    void append(size_t number, size_t width) {
+        char digits[24];
+        size_t count = 0;
+        do {
+            digits[count++] = '0' + number % 10;
+            number /= 10;
+        } while (number != 0);
+        while (count < width && m_length < sizeof m_text) {
+            m_text[m_length++] = ' ';
+            width--;
+        }
+        while (count > 0 && m_length < sizeof m_text) {
+            m_text[m_length++] = digits[--count];
+        }
+    }
+
+    void write(int fd) {
+        append("\n");
+        ssize_t written = ::write(fd, m_text, m_length);
+        (void)written;
+    }
+
+private:
+    void pad(size_t start, size_t width) {
+        while (m_length - start < width && m_length < sizeof m_text) {
+            m_text[m_length++] = ' ';
+        }
+    }
+
+    char   m_text[128];
+    size_t m_length;
+};
+
+void LiveCount::dump(int fd)
+{
+    DumpLine heading;
+    heading.append("live", 20);
+    heading.append("       objects         bytes");
+    heading.write(fd);
+
+    size_t objects = 0, bytes = 0;
+    for (const LiveCount* count = first(); count; count = count->next) {
+        DumpLine line;
+        line.append(count->name, 20);
+        line.append(count->objects, 14);
+        line.append(count->bytes, 14);
+        line.write(fd);
+        objects += count->objects;
+        bytes += count->bytes;
+    }
+
+    DumpLine total;
+    total.append("total", 20);
+    total.append(objects, 14);
+    total.append(bytes, 14);
+    total.write(fd);
+}
+
+static void dumpOnSignal(int)
+{
+    LiveCount::dump(STDERR_FILENO);
+}
+
+static struct DumpSignal {
+    DumpSignal() {
+        struct sigaction action = { };
+        action.sa_handler = dumpOnSignal;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGUSR1, &action, NULL);
+    }
+} dumpSignal;
@@ -0,0 +1,66 @@
+#ifndef INCLUDE_MEMORYSTATS_H
+#define INCLUDE_MEMORYSTATS_H
+
+#include "Nursery.h"
+
+#include <cstddef>
+#include <utility>
+
+//  Counts of what's live, by type, kept up to date as objects are made and
+//  destroyed, so that they're always to hand: mem-stats returns them, and
+//  sending the process SIGUSR1 writes them to stderr, whatever it's doing.
+//
+//  A class is counted by deriving from Counted<itself, its base>, which adds
+//  nothing to its size, and so passes its base's constructor arguments on
+//  through Counted, and by naming itself with COUNT_LIVE in its .cpp. It's
+//  not a second base, as that would slow down every dynamic_cast. The
+//  buffers of value vectors are counted by their allocator.
+
+struct LiveCount {
+    const char* name;
+    size_t      objects;
+    size_t      bytes;
+    LiveCount*  next;
+
+    void add(size_t size) { objects++; bytes += size; }
+    void remove(size_t size) { objects--; bytes -= size; }
+
+    // The first of all the named counts, which are linked through next.
+    static const LiveCount* first();
+
+    // Writes every count to fd, using only what a signal handler may.
+    static void dump(int fd);
+
+    // Those of the buffers of value vectors.
+    static LiveCount valueBuffers;
+};
+
+template<class T, class Base>
+class Counted : public Base {
+public:
+    // Plain data, as objects are made during static construction.
+    static LiveCount s_live;
+
+protected:
+    template<class... Args>
+    Counted(Args&&... args) : Base(std::forward<Args>(args)...) {
+#ifdef MAL_COMPRESSED_REFS
+        // Anything larger couldn't be allocated in the Nursery's region.
+        static_assert(sizeof(T) <= Nursery::LARGEST,
+                      "A counted object is too large for the Nursery");
+#endif
+        s_live.add(sizeof(T));
+    }
+    ~Counted() { s_live.remove(sizeof(T)); }
+};
+
+template<class T, class Base> LiveCount Counted<T, Base>::s_live;
+
+struct LiveCountName {
+    LiveCountName(LiveCount& count, const char* name);
+};
+
+#define COUNT_LIVE(Type) \
+    static LiveCountName liveCountName_##Type(Type::s_live, #Type)
+
+#endif // INCLUDE_MEMORYSTATS_H
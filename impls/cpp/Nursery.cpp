@@ -0,0 +1,199 @@
+#include "Nursery.h"
+
+#include <new>
+#include <sys/mman.h>
+#include <unistd.h>
+
+//  The chunks are carved from a single range of address space, reserved up
+//  front (only the pages which are used take up memory), so telling whether
+//  an object came from here is a matter of comparing addresses. The chunks
+//  are aligned to their size, so the one an object is in is found by masking
+//  its address. With compressed references the region is as large as an
+//  offset can reach, as every counted object has to be in it.
+#ifdef MAL_COMPRESSED_REFS
+static const size_t REGION_SIZE = (size_t(1) << 32) * sizeof(void*);
+#else
+static const size_t REGION_SIZE = size_t(1) << 30;
+#endif
+static const size_t CHUNK_SIZE = 64 << 10;
+
+//  How many emptied chunks keep their memory, ready for reuse; the pages of
+//  any more are given back.
+static const size_t SPARE_CHUNKS = 16;
+
+//  How much of the chunks in use may be dead space, pinned by the objects
+//  still live in them, beyond twice what those objects take up.
+static const size_t PINNED_SLACK = 1 << 20;
+
+struct Chunk {
+    size_t cellSize;    // 0 for a nursery chunk
+    char* next;
+    size_t liveCount;
+    Chunk* nextEmpty;
+
+    char* start() { return reinterpret_cast<char*>(this + 1); }
+    char* end() { return reinterpret_cast<char*>(this) + CHUNK_SIZE; }
+};
+
+//  Plain data, so that objects may be made and freed during static
+//  construction and destruction.
+char* Nursery::s_regionStart = NULL;
+static char* regionEnd = NULL;
+static char* untouched = NULL;      // the chunks after this were never used
+static size_t pageSize = 0;
+
+static Chunk* current = NULL;
+static Chunk* spares = NULL;        // emptied, and keeping their memory
+static size_t spareCount = 0;
+static Chunk* released = NULL;      // emptied, with their memory given back
+static size_t chunksInUse = 0;
+static size_t liveBytes = 0;
+
+//  The free cells of each size, for the objects taken to be long lived.
+//  Their chunks are never given back.
+static void* freeCells[Nursery::LARGEST / sizeof(void*) + 1];
+
+static Chunk* chunkOf(void* p)
+{
+    return reinterpret_cast<Chunk*>(
+        reinterpret_cast<uintptr_t>(p) & ~(CHUNK_SIZE - 1));
+}
+
+static size_t aligned(size_t size)
+{
+    return (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+}
+
+static char* reserveRegion()
+{
+    void* memory = mmap(NULL, REGION_SIZE + CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t start = (reinterpret_cast<uintptr_t>(memory) + CHUNK_SIZE - 1)
+                    & ~(CHUNK_SIZE - 1);
+    untouched = reinterpret_cast<char*>(start);
+    regionEnd = untouched + REGION_SIZE;
+    pageSize = sysconf(_SC_PAGESIZE);
+    return untouched;
+}
+
+// Returns NULL if there's no chunk to be had.
+static Chunk* newChunk()
+{
+    Chunk* chunk;
+    if (spares != NULL) {
+        chunk = spares;
+        spares = chunk->nextEmpty;
+        spareCount--;
+    }
+    else if (released != NULL) {
+        chunk = released;
+        released = chunk->nextEmpty;
+    }
+    else {
+        if (untouched == regionEnd) {
+            return NULL;
+        }
+        chunk = reinterpret_cast<Chunk*>(untouched);
+        untouched += CHUNK_SIZE;
+    }
+    chunk->cellSize = 0;
+    chunk->next = chunk->start();
+    chunk->liveCount = 0;
+    return chunk;
+}
+
+static void* allocateCell(size_t size)
+{
+    void*& head = freeCells[size / sizeof(void*)];
+    if (head == NULL) {
+        Chunk* chunk = newChunk();
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->cellSize = size;
+
+        // Pushed last to first, so they're handed out in address order.
+        size_t count = (chunk->end() - chunk->start()) / size;
+        for (size_t i = count; i-- > 0; ) {
+            void* cell = chunk->start() + i * size;
+            *static_cast<void**>(cell) = head;
+            head = cell;
+        }
+    }
+    void* cell = head;
+    head = *static_cast<void**>(cell);
+    return cell;
+}
+
+void* Nursery::allocate(size_t size)
+{
+    if (size > LARGEST) {
+        return NULL;
+    }
+    if (s_regionStart == NULL && (s_regionStart = reserveRegion()) == NULL) {
+        return NULL;
+    }
+    size = aligned(size);
+
+    // A full chunk still has live objects, or it would have been emptied
+    // by the last of them being freed; it's left to them.
+    if (current == NULL || size > size_t(current->end() - current->next)) {
+        // Long lived objects scattered among the dead can pin any number of
+        // chunks, so they're allocated elsewhere until enough of them die.
+        if (chunksInUse * CHUNK_SIZE > 2 * liveBytes + PINNED_SLACK) {
+            return allocateCell(size);
+        }
+        Chunk* chunk = newChunk();
+        if (chunk == NULL) {
+            return NULL;
+        }
+        current = chunk;
+        chunksInUse++;
+    }
+    void* p = current->next;
+    current->next += size;
+    current->liveCount++;
+    liveBytes += size;
+    return p;
+}
+
+bool Nursery::free(void* p, size_t size)
+{
+    if (p < s_regionStart || p >= regionEnd) {
+        return false;
+    }
+    Chunk* chunk = chunkOf(p);
+    if (chunk->cellSize != 0) {
+        void*& head = freeCells[chunk->cellSize / sizeof(void*)];
+        *static_cast<void**>(p) = head;
+        head = p;
+        return true;
+    }
+
+    liveBytes -= aligned(size);
+    if (--chunk->liveCount > 0) {
+        return true;
+    }
+    if (chunk == current) {
+        chunk->next = chunk->start();
+        return true;
+    }
+    chunksInUse--;
+    if (spareCount < SPARE_CHUNKS) {
+        chunk->nextEmpty = spares;
+        spares = chunk;
+        spareCount++;
+        return true;
+    }
+    // All but the page with the header, which is still in use.
+    char* pages = reinterpret_cast<char*>(chunk) + pageSize;
+    if (pages < chunk->end()) {
+        madvise(pages, chunk->end() - pages, MADV_DONTNEED);
+    }
+    chunk->nextEmpty = released;
+    released = chunk;
+    return true;
+}
@@ -0,0 +1,54 @@
+#ifndef INCLUDE_NURSERY_H
+#define INCLUDE_NURSERY_H
+
+#include <cstddef>
+#include <stdint.h>
+
+//  Where small counted objects are allocated, by bumping a pointer through
+//  a chunk of memory. Most objects made while evaluating a form die before
+//  it finishes, and a chunk keeps no record of which of its objects are
+//  free, only how many are live: once they've all gone, the whole chunk is
+//  reused at once.
+//
+//  Nothing is moved. An object which outlives its form, by being bound in an
+//  environment or kept in an atom, stays where it is, keeping its chunk out
+//  of use until it dies; a full chunk which still holds any is left to them
+//  and a fresh one started. If so many chunks are kept that way that most of
+//  their space is dead, new objects are allocated as though they were known
+//  to be long lived, from chunks of cells of one size with a free list,
+//  until enough of those chunks have emptied.
+//
+//  All of it is in a single region of address space, so an object in it can
+//  be referred to by its offset into the region (see CompressedPtr.h).
+
+class Nursery {
+public:
+    // The largest allocation it handles. Built with MAL_COMPRESSED_REFS,
+    // nothing larger can be a counted object, as Counted checks.
+    static const size_t LARGEST = 256;
+
+    // Returns NULL if the region is full.
+    static void* allocate(size_t size);
+
+    // Returns false if p wasn't allocated here.
+    static bool free(void* p, size_t size);
+
+    // Objects are aligned to ALIGNMENT, so an offset counts in those units,
+    // and 0, being within the header of the first chunk, means NULL.
+    static uint32_t offsetOf(const void* p) {
+        return p == NULL ? 0
+            : static_cast<uint32_t>(
+                (static_cast<const char*>(p) - s_regionStart) / ALIGNMENT);
+    }
+    static void* address(uint32_t offset) {
+        return offset == 0 ? NULL : s_regionStart + size_t(offset) * ALIGNMENT;
+    }
+
+private:
+    // Nothing counted has a member needing more than a pointer's alignment.
+    static const size_t ALIGNMENT = sizeof(void*);
+
+    static char* s_regionStart;
+};
+
+#endif // INCLUDE_NURSERY_H
@@ -0,0 +1,112 @@
+#ifndef INCLUDE_POINTERSET_H
+#define INCLUDE_POINTERSET_H
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+
+//  An open-addressed hash set of pointers, for the collectors' bookkeeping.
+//  It's plain data, with nothing to construct or destroy, so that a static
+//  one can be used while objects are made and freed during static
+//  construction and destruction; it starts out empty when zero-initialized.
+
+struct PointerSet {
+    const void** slots;     // the entries are those which aren't NULL
+    size_t count;
+    size_t capacity;
+    int shift;
+
+    bool contains(const void* p) const {
+        if (count == 0) {
+            return false;
+        }
+        size_t mask = capacity - 1;
+        for (size_t i = home(p); slots[i] != NULL; i = (i + 1) & mask) {
+            if (slots[i] == p) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // p must not already be present.
+    void insert(const void* p) {
+        if (2 * (count + 1) > capacity) {
+            grow();
+        }
+        place(p);
+    }
+
+    // p must be present.
+    void remove(const void* p) {
+        size_t mask = capacity - 1;
+        size_t i = home(p);
+        while (slots[i] != p) {
+            i = (i + 1) & mask;
+        }
+
+        // Shift back any later entries in the run which would otherwise no
+        // longer be found from their home slot.
+        for (size_t j = (i + 1) & mask; slots[j] != NULL; j = (j + 1) & mask) {
+            size_t h = home(slots[j]);
+            bool reachable = i <= j ? (i < h && h <= j) : (i < h || h <= j);
+            if (!reachable) {
+                slots[i] = slots[j];
+                i = j;
+            }
+        }
+        slots[i] = NULL;
+        count--;
+    }
+
+    // Empties the set, keeping its capacity.
+    void clear() {
+        if (count > 0) {
+            memset(slots, 0, capacity * sizeof *slots);
+            count = 0;
+        }
+    }
+
+private:
+    size_t home(const void* p) const {
+        uint64_t bits = reinterpret_cast<uintptr_t>(p);
+        return static_cast<size_t>((bits * 0x9E3779B97F4A7C15ull) >> shift);
+    }
+
+    void place(const void* p) {
+        size_t mask = capacity - 1;
+        size_t i = home(p);
+        while (slots[i] != NULL) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = p;
+        count++;
+    }
+
+    void grow() {
+        const void** old = slots;
+        size_t oldCapacity = capacity;
+
+        size_t newCapacity = oldCapacity == 0 ? 1024 : oldCapacity * 2;
+        void* grown = calloc(newCapacity, sizeof *slots);
+        if (grown == NULL) {
+            throw std::bad_alloc();
+        }
+        slots = static_cast<const void**>(grown);
+        capacity = newCapacity;
+        count = 0;
+        for (shift = 64; newCapacity > 1; newCapacity >>= 1) {
+            shift--;
+        }
+
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (old[i] != NULL) {
+                place(old[i]);
+            }
+        }
+        free(old);
+    }
+};
+
+#endif // INCLUDE_POINTERSET_H
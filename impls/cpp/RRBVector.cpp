@@ -0,0 +1,706 @@
+#include "RRBVector.h"
+#include "Types.h"
+
+#include <algorithm>
+
+#define RRB_BITS    5
+#define RRB_WIDTH   (1 << RRB_BITS)
+#define RRB_EXTRAS  2   // extra nodes a concatenation may leave on a level
+
+typedef std::vector<RRBNodePtr> RRBNodeVec;
+
+class RRBLeaf : public Counted<RRBLeaf, RRBNode> {
+public:
+    RRBLeaf(malValueRefVec& items, malOwner owner = NO_OWNER)
+    : Counted(0, items.size(), owner) {
+        m_items.swap(items);
+    }
+#ifdef MAL_COMPRESSED_REFS
+    RRBLeaf(malValueVec& items, malOwner owner = NO_OWNER)
+    : Counted(0, items.size(), owner) {
+        moveItems(items, m_items);
+    }
+#endif
+
+    const malValueRefVec& items() const { return m_items; }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        for (auto it = m_items.begin(); it != m_items.end(); ++it) {
+            children.push_back(it->ptr());
+        }
+    }
+#ifdef MAL_TRACING_GC
+    virtual const void* ownedBuffer() const { return m_items.data(); }
+#endif
+
+    // Only for leaves which are not shared.
+    void push(malValuePtr value, bool atBack) {
+        m_items.insert(atBack ? m_items.end() : m_items.begin(), value);
+        setSize(m_items.size());
+    }
+    void popFront() {
+        m_items.erase(m_items.begin());
+        setSize(m_items.size());
+    }
+
+private:
+    malValueRefVec m_items;
+};
+
+class RRBBranch : public Counted<RRBBranch, RRBNode> {
+public:
+    RRBBranch(int height, RRBNodeVec& children, malOwner owner = NO_OWNER)
+    : Counted(height, totalSize(children), owner) {
+        m_children.swap(children);
+        m_sizes.reserve(m_children.size());
+        int size = 0;
+        for (auto it = m_children.begin(); it != m_children.end(); ++it) {
+            size += (*it)->size();
+            m_sizes.push_back(size);
+        }
+    }
+
+    const RRBNodeVec& children() const { return m_children; }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        for (auto it = m_children.begin(); it != m_children.end(); ++it) {
+            children.push_back(it->ptr());
+        }
+    }
+
+    // Returns the child holding item index, and makes index relative to it.
+    int childIndex(int& index) const {
+        // Children hold at most 32^height items, so this never overshoots.
+        int slot = index >> (RRB_BITS * height());
+        while (m_sizes[slot] <= index) {
+            slot++;
+        }
+        if (slot > 0) {
+            index -= m_sizes[slot - 1];
+        }
+        return slot;
+    }
+
+    int offsetOf(int slot) const {
+        return slot == 0 ? 0 : m_sizes[slot - 1];
+    }
+
+    // Only for branches which are not shared. The child may have changed
+    // size in place, so the sizes from its slot onwards are refreshed.
+    void setChild(int slot, RRBNodePtr child) {
+        m_children[slot] = child;
+        refreshSizes(slot);
+    }
+    void insertChild(int slot, RRBNodePtr child) {
+        m_children.insert(m_children.begin() + slot, child);
+        m_sizes.insert(m_sizes.begin() + slot, 0);
+        refreshSizes(slot);
+    }
+    void removeChild(int slot) {
+        m_children.erase(m_children.begin() + slot);
+        m_sizes.erase(m_sizes.begin() + slot);
+        refreshSizes(slot);
+    }
+
+private:
+    void refreshSizes(int slot) {
+        int size = offsetOf(slot);
+        for (int i = slot; i < (int)m_children.size(); i++) {
+            size += m_children[i]->size();
+            m_sizes[i] = size;
+        }
+        setSize(size);
+    }
+
+    static int totalSize(const RRBNodeVec& children) {
+        int size = 0;
+        for (auto it = children.begin(); it != children.end(); ++it) {
+            size += (*it)->size();
+        }
+        return size;
+    }
+
+    RRBNodeVec       m_children;
+    std::vector<int> m_sizes; // cumulative
+};
+
+COUNT_LIVE(RRBLeaf);
+COUNT_LIVE(RRBBranch);
+
+static const RRBLeaf* asLeaf(const RRBNodePtr& node)
+{
+    return static_cast<const RRBLeaf*>(node.ptr());
+}
+
+static const RRBBranch* asBranch(const RRBNodePtr& node)
+{
+    return static_cast<const RRBBranch*>(node.ptr());
+}
+
+static int slotCount(const RRBNodePtr& node)
+{
+    return node->height() == 0 ? asLeaf(node)->items().size()
+                               : asBranch(node)->children().size();
+}
+
+static RRBNodePtr makeLeaf(malValueRefVec& items)
+{
+    return RRBNodePtr(new RRBLeaf(items));
+}
+
+#ifdef MAL_COMPRESSED_REFS
+static RRBNodePtr makeLeaf(malValueVec& items)
+{
+    return RRBNodePtr(new RRBLeaf(items));
+}
+#endif
+
+static RRBNodePtr makeBranch(int height, RRBNodeVec& children)
+{
+    return RRBNodePtr(new RRBBranch(height, children));
+}
+
+static RRBNodePtr makeBranch(RRBNodePtr a, RRBNodePtr b)
+{
+    RRBNodeVec children;
+    children.push_back(a);
+    children.push_back(b);
+    return makeBranch(a->height() + 1, children);
+}
+
+// Removes any chain of single-child branches from the top of the tree.
+static RRBNodePtr collapse(RRBNodePtr root)
+{
+    while (root && root->height() > 0 &&
+           asBranch(root)->children().size() == 1) {
+        root = asBranch(root)->children()[0];
+    }
+    return root;
+}
+
+static RRBNodePtr build(malValueVec& items)
+{
+    if (items.empty()) {
+        return NULL;
+    }
+    if (items.size() <= RRB_WIDTH) {
+        return makeLeaf(items);
+    }
+
+    RRBNodeVec level;
+    for (auto it = items.begin(); it != items.end(); ) {
+        auto next = it + std::min<int>(RRB_WIDTH, items.end() - it);
+        malValueRefVec chunk(it, next);
+        level.push_back(makeLeaf(chunk));
+        it = next;
+    }
+    for (int height = 1; level.size() > 1; height++) {
+        RRBNodeVec parents;
+        for (auto it = level.begin(); it != level.end(); ) {
+            auto next = it + std::min<int>(RRB_WIDTH, level.end() - it);
+            RRBNodeVec chunk(it, next);
+            parents.push_back(makeBranch(height, chunk));
+            it = next;
+        }
+        level.swap(parents);
+    }
+    return level[0];
+}
+
+RRBVector::RRBVector()
+: m_count(0)
+{
+
+}
+
+RRBVector::RRBVector(malValueVec* items)
+: m_root(build(*items))
+, m_count(m_root ? m_root->size() : 0)
+{
+    delete items;
+}
+
+RRBVector::RRBVector(malValueIter begin, malValueIter end)
+{
+    malValueVec items(begin, end);
+    m_root = build(items);
+    m_count = m_root ? m_root->size() : 0;
+}
+
+RRBVector::RRBVector(RRBNodePtr root)
+: m_root(collapse(root))
+, m_count(m_root ? m_root->size() : 0)
+{
+
+}
+
+const malValueRef* RRBVector::leafFor(int index,
+                                      int& leafStart, int& leafEnd) const
+{
+    leafStart = index;
+    const RRBNode* node = m_root.ptr();
+    while (node->height() > 0) {
+        const RRBBranch* branch = static_cast<const RRBBranch*>(node);
+        node = branch->children()[branch->childIndex(index)].ptr();
+    }
+    leafStart -= index;
+    leafEnd = leafStart + node->size();
+    return &static_cast<const RRBLeaf*>(node)->items()[0];
+}
+
+malValuePtr RRBVector::item(int index) const
+{
+    const RRBNode* node = m_root.ptr();
+    while (node->height() > 0) {
+        const RRBBranch* branch = static_cast<const RRBBranch*>(node);
+        node = branch->children()[branch->childIndex(index)].ptr();
+    }
+    return static_cast<const RRBLeaf*>(node)->items()[index];
+}
+
+//  Adds value at the back (or front) of node. If node has no room left, it is
+//  returned unchanged and overflow is set to a new node of the same height,
+//  holding just the value, which the caller must place alongside it.
+static RRBNodePtr pushInto(const RRBNodePtr& node, malValuePtr value,
+                           bool atBack, RRBNodePtr& overflow)
+{
+    if (node->height() == 0) {
+        const malValueRefVec& items = asLeaf(node)->items();
+        malValueRefVec newItems;
+        if (items.size() == RRB_WIDTH) {
+            newItems.push_back(value);
+            overflow = makeLeaf(newItems);
+            return node;
+        }
+        newItems.reserve(items.size() + 1);
+        if (!atBack) {
+            newItems.push_back(value);
+        }
+        newItems.insert(newItems.end(), items.begin(), items.end());
+        if (atBack) {
+            newItems.push_back(value);
+        }
+        return makeLeaf(newItems);
+    }
+
+    const RRBNodeVec& children = asBranch(node)->children();
+    int slot = atBack ? children.size() - 1 : 0;
+    RRBNodePtr childOverflow;
+    RRBNodePtr child = pushInto(children[slot], value, atBack, childOverflow);
+
+    RRBNodeVec newChildren(children);
+    newChildren[slot] = child;
+    if (childOverflow) {
+        if (children.size() == RRB_WIDTH) {
+            RRBNodeVec single(1, childOverflow);
+            overflow = makeBranch(node->height(), single);
+            return node;
+        }
+        newChildren.insert(atBack ? newChildren.end() : newChildren.begin(),
+                           childOverflow);
+    }
+    return makeBranch(node->height(), newChildren);
+}
+
+RRBVector RRBVector::pushBack(malValuePtr value) const
+{
+    if (!m_root) {
+        malValueRefVec items(1, value);
+        return RRBVector(makeLeaf(items));
+    }
+    RRBNodePtr overflow;
+    RRBNodePtr root = pushInto(m_root, value, true, overflow);
+    return RRBVector(overflow ? makeBranch(root, overflow) : root);
+}
+
+RRBVector RRBVector::pushFront(malValuePtr value) const
+{
+    if (!m_root) {
+        malValueRefVec items(1, value);
+        return RRBVector(makeLeaf(items));
+    }
+    RRBNodePtr overflow;
+    RRBNodePtr root = pushInto(m_root, value, false, overflow);
+    return RRBVector(overflow ? makeBranch(overflow, root) : root);
+}
+
+//  Returns a copy of node which owner may update in place, with room for a
+//  full complement of items or children.
+static RRBNodePtr ownedCopy(const RRBNodePtr& node, malOwner owner)
+{
+    if (node->height() == 0) {
+        malValueRefVec items;
+        items.reserve(RRB_WIDTH);
+        items.assign(asLeaf(node)->items().begin(),
+                     asLeaf(node)->items().end());
+        return RRBNodePtr(new RRBLeaf(items, owner));
+    }
+    RRBNodeVec children;
+    children.reserve(RRB_WIDTH);
+    children.assign(asBranch(node)->children().begin(),
+                    asBranch(node)->children().end());
+    return RRBNodePtr(new RRBBranch(node->height(), children, owner));
+}
+
+//  Returns node if it may be updated in place, being owned by owner or not
+//  shared with any other vector, otherwise a copy of it which may be.
+static RRBNodePtr editable(const RRBNodePtr& node, malOwner owner,
+                           bool unique)
+{
+    return unique || (owner != NO_OWNER && node->owner() == owner)
+        ? node : ownedCopy(node, owner);
+}
+
+//  The in-place operations below take unique to say whether every node above
+//  this one is unique, and so whether it can be if nothing else refers to it.
+
+//  As pushInto, but updating nodes in place where editable allows, and giving
+//  owner any nodes which it copies or creates.
+static RRBNodePtr pushInPlace(const RRBNodePtr& node, malValuePtr value,
+                              bool atBack, malOwner owner, bool unique,
+                              RRBNodePtr& overflow)
+{
+    unique = unique && node->refCount() == 1;
+    if (node->height() == 0) {
+        if (slotCount(node) == RRB_WIDTH) {
+            malValueRefVec items(1, value);
+            overflow = RRBNodePtr(new RRBLeaf(items, owner));
+            return node;
+        }
+        RRBNodePtr leaf = editable(node, owner, unique);
+        static_cast<RRBLeaf*>(leaf.ptr())->push(value, atBack);
+        return leaf;
+    }
+
+    const RRBNodeVec& children = asBranch(node)->children();
+    int slot = atBack ? children.size() - 1 : 0;
+    RRBNodePtr childOverflow;
+    RRBNodePtr child = pushInPlace(children[slot], value, atBack,
+                                   owner, unique, childOverflow);
+    if (childOverflow && children.size() == RRB_WIDTH) {
+        RRBNodeVec single(1, childOverflow);
+        overflow = RRBNodePtr(new RRBBranch(node->height(), single, owner));
+        return node;
+    }
+
+    RRBNodePtr result = editable(node, owner, unique);
+    RRBBranch* branch = static_cast<RRBBranch*>(result.ptr());
+    branch->setChild(slot, child);
+    if (childOverflow) {
+        branch->insertChild(atBack ? slot + 1 : 0, childOverflow);
+    }
+    return result;
+}
+
+// Removes the first item from node, or returns NULL if that would empty it.
+static RRBNodePtr popFrontInPlace(const RRBNodePtr& node,
+                                  malOwner owner, bool unique)
+{
+    unique = unique && node->refCount() == 1;
+    if (node->height() == 0) {
+        if (node->size() == 1) {
+            return NULL;
+        }
+        RRBNodePtr leaf = editable(node, owner, unique);
+        static_cast<RRBLeaf*>(leaf.ptr())->popFront();
+        return leaf;
+    }
+
+    const RRBNodeVec& children = asBranch(node)->children();
+    RRBNodePtr child = popFrontInPlace(children[0], owner, unique);
+    if (!child && children.size() == 1) {
+        return NULL;
+    }
+
+    RRBNodePtr result = editable(node, owner, unique);
+    RRBBranch* branch = static_cast<RRBBranch*>(result.ptr());
+    if (child) {
+        branch->setChild(0, child);
+    }
+    else {
+        branch->removeChild(0);
+    }
+    return result;
+}
+
+void RRBVector::pushInPlace(malValuePtr value, bool atBack, malOwner owner)
+{
+    if (!m_root) {
+        malValueRefVec items(1, value);
+        m_root = RRBNodePtr(new RRBLeaf(items, owner));
+    }
+    else {
+        RRBNodePtr overflow;
+        m_root = ::pushInPlace(m_root, value, atBack, owner, true, overflow);
+        if (overflow) {
+            RRBNodeVec children;
+            children.push_back(atBack ? m_root : overflow);
+            children.push_back(atBack ? overflow : m_root);
+            m_root = RRBNodePtr(new RRBBranch(m_root->height() + 1,
+                                              children, owner));
+        }
+    }
+    m_count++;
+}
+
+void RRBVector::pushBackInPlace(malValuePtr value, malOwner owner)
+{
+    pushInPlace(value, true, owner);
+}
+
+void RRBVector::pushFrontInPlace(malValuePtr value, malOwner owner)
+{
+    pushInPlace(value, false, owner);
+}
+
+void RRBVector::popFrontInPlace(malOwner owner)
+{
+    m_root = collapse(::popFrontInPlace(m_root, owner, true));
+    m_count--;
+}
+
+void RRBVector::concatInPlace(const RRBVector& that, malOwner owner)
+{
+    // Appending a leaf's worth of items is cheaper than rebuilding the seam.
+    if (that.count() > RRB_WIDTH) {
+        *this = concat(that);
+        return;
+    }
+    for (Iterator it = that.begin(), end = that.end(); it != end; ++it) {
+        pushBackInPlace(*it, owner);
+    }
+}
+
+// Returns the first count items of node, 0 < count <= node->size().
+static RRBNodePtr takeFrom(const RRBNodePtr& node, int count)
+{
+    if (count == node->size()) {
+        return node;
+    }
+    if (node->height() == 0) {
+        const malValueRefVec& items = asLeaf(node)->items();
+        malValueRefVec newItems(items.begin(), items.begin() + count);
+        return makeLeaf(newItems);
+    }
+
+    const RRBBranch* branch = asBranch(node);
+    int index = count - 1;
+    int slot = branch->childIndex(index);
+    RRBNodeVec children(branch->children().begin(),
+                        branch->children().begin() + slot);
+    children.push_back(takeFrom(branch->children()[slot], index + 1));
+    return makeBranch(node->height(), children);
+}
+
+// Returns node without its first count items, 0 <= count < node->size().
+static RRBNodePtr dropFrom(const RRBNodePtr& node, int count)
+{
+    if (count == 0) {
+        return node;
+    }
+    if (node->height() == 0) {
+        const malValueRefVec& items = asLeaf(node)->items();
+        malValueRefVec newItems(items.begin() + count, items.end());
+        return makeLeaf(newItems);
+    }
+
+    const RRBBranch* branch = asBranch(node);
+    int index = count;
+    int slot = branch->childIndex(index);
+    RRBNodeVec children;
+    children.reserve(branch->children().size() - slot);
+    children.push_back(dropFrom(branch->children()[slot], index));
+    children.insert(children.end(), branch->children().begin() + slot + 1,
+                                    branch->children().end());
+    return makeBranch(node->height(), children);
+}
+
+RRBVector RRBVector::take(int count) const
+{
+    if (count >= m_count) {
+        return *this;
+    }
+    return count <= 0 ? RRBVector() : RRBVector(takeFrom(m_root, count));
+}
+
+RRBVector RRBVector::drop(int count) const
+{
+    if (count <= 0) {
+        return *this;
+    }
+    return count >= m_count ? RRBVector() : RRBVector(dropFrom(m_root, count));
+}
+
+//  Works out how to redistribute the slots of a row of sibling nodes so that
+//  the row has at most RRB_EXTRAS more nodes than the optimum. Nodes which
+//  are nearly full are left alone, underfull ones are merged into their
+//  right-hand neighbours. Returns the new slot count of each node.
+static std::vector<int> concatPlan(const RRBNodeVec& nodes)
+{
+    std::vector<int> sizes;
+    int total = 0;
+    for (auto it = nodes.begin(); it != nodes.end(); ++it) {
+        sizes.push_back(slotCount(*it));
+        total += sizes.back();
+    }
+
+    int optimal = (total + RRB_WIDTH - 1) / RRB_WIDTH;
+    if (optimal <= 1) {
+        return std::vector<int>(1, total);
+    }
+
+    int n = sizes.size();
+    int i = 0;
+    while (n > optimal + RRB_EXTRAS) {
+        while (sizes[i] > RRB_WIDTH - RRB_EXTRAS / 2) {
+            i++;
+        }
+        int remaining = sizes[i];
+        while (remaining > 0 && i + 1 < n) {
+            int merged = std::min(remaining + sizes[i + 1], RRB_WIDTH);
+            sizes[i] = merged;
+            remaining += sizes[i + 1] - merged;
+            i++;
+        }
+        std::copy(sizes.begin() + i + 1, sizes.begin() + n,
+                  sizes.begin() + i);
+        n--;
+        i = std::max(i - 1, 0);
+    }
+    sizes.resize(n);
+    return sizes;
+}
+
+//  Copies the slots of nodes into new nodes according to plan. Nodes which
+//  the plan leaves untouched are shared rather than copied.
+template<class Slots>
+static RRBNodeVec executePlan(const RRBNodeVec& nodes,
+                              const std::vector<int>& plan,
+                              const Slots& (*slotsOf)(const RRBNode*),
+                              RRBNodePtr (*make)(Slots&, int))
+{
+    RRBNodeVec result;
+    int height = nodes[0]->height();
+    int node = 0, offset = 0;
+    for (auto size = plan.begin(); size != plan.end(); ++size) {
+        if (offset == 0 && slotCount(nodes[node]) == *size) {
+            result.push_back(nodes[node++]);
+            continue;
+        }
+        Slots slots;
+        slots.reserve(*size);
+        while ((int)slots.size() < *size) {
+            const Slots& source = slotsOf(nodes[node].ptr());
+            int wanted = std::min<int>(*size - slots.size(),
+                                       source.size() - offset);
+            slots.insert(slots.end(), source.begin() + offset,
+                                      source.begin() + offset + wanted);
+            offset += wanted;
+            if (offset == (int)source.size()) {
+                node++;
+                offset = 0;
+            }
+        }
+        result.push_back(make(slots, height));
+    }
+    return result;
+}
+
+static const malValueRefVec& leafItems(const RRBNode* node)
+{
+    return static_cast<const RRBLeaf*>(node)->items();
+}
+
+static const RRBNodeVec& branchChildren(const RRBNode* node)
+{
+    return static_cast<const RRBBranch*>(node)->children();
+}
+
+static RRBNodePtr remakeLeaf(malValueRefVec& items, int height)
+{
+    return makeLeaf(items);
+}
+
+static RRBNodePtr remakeBranch(RRBNodeVec& children, int height)
+{
+    return makeBranch(height, children);
+}
+
+//  Rebalances the children of height-1 around a concatenation seam: all but
+//  the last child of left, then middle, then all but the first child of right.
+//  Returns one or two nodes of the given height.
+static RRBNodeVec rebalance(const RRBNodePtr& left, const RRBNodeVec& middle,
+                            const RRBNodePtr& right, int height)
+{
+    RRBNodeVec nodes;
+    if (left) {
+        const RRBNodeVec& children = asBranch(left)->children();
+        nodes.insert(nodes.end(), children.begin(), children.end() - 1);
+    }
+    nodes.insert(nodes.end(), middle.begin(), middle.end());
+    if (right) {
+        const RRBNodeVec& children = asBranch(right)->children();
+        nodes.insert(nodes.end(), children.begin() + 1, children.end());
+    }
+
+    std::vector<int> plan = concatPlan(nodes);
+    RRBNodeVec balanced = (height == 1)
+        ? executePlan(nodes, plan, leafItems, remakeLeaf)
+        : executePlan(nodes, plan, branchChildren, remakeBranch);
+
+    RRBNodeVec result;
+    if (balanced.size() <= RRB_WIDTH) {
+        result.push_back(makeBranch(height, balanced));
+    }
+    else {
+        RRBNodeVec tail(balanced.begin() + RRB_WIDTH, balanced.end());
+        balanced.resize(RRB_WIDTH);
+        result.push_back(makeBranch(height, balanced));
+        result.push_back(makeBranch(height, tail));
+    }
+    return result;
+}
+
+//  Joins left and right, returning one or two nodes of the greater height
+//  of the two. Leaves are returned as they are, to be rebalanced by the
+//  caller one level up.
+static RRBNodeVec concatNodes(const RRBNodePtr& left, const RRBNodePtr& right)
+{
+    int leftHeight = left->height(), rightHeight = right->height();
+    if (leftHeight == 0 && rightHeight == 0) {
+        RRBNodeVec result;
+        result.push_back(left);
+        result.push_back(right);
+        return result;
+    }
+    if (leftHeight > rightHeight) {
+        RRBNodeVec middle =
+            concatNodes(asBranch(left)->children().back(), right);
+        return rebalance(left, middle, NULL, leftHeight);
+    }
+    if (leftHeight < rightHeight) {
+        RRBNodeVec middle =
+            concatNodes(left, asBranch(right)->children().front());
+        return rebalance(NULL, middle, right, rightHeight);
+    }
+    RRBNodeVec middle = concatNodes(asBranch(left)->children().back(),
+                                    asBranch(right)->children().front());
+    return rebalance(left, middle, right, leftHeight);
+}
+
+RRBVector RRBVector::concat(const RRBVector& that) const
+{
+    if (!m_root) {
+        return that;
+    }
+    if (!that.m_root) {
+        return *this;
+    }
+
+    RRBNodeVec nodes = concatNodes(m_root, that.m_root);
+    if (nodes[0]->height() == 0) {
+        nodes = rebalance(NULL, nodes, NULL, 1);
+    }
+    return RRBVector(nodes.size() == 1 ? nodes[0]
+                                       : makeBranch(nodes[0], nodes[1]));
+}
@@ -0,0 +1,154 @@
+#ifndef INCLUDE_RRBVECTOR_H
+#define INCLUDE_RRBVECTOR_H
+
+#include "MAL.h"
+
+#include <iterator>
+
+//  A persistent relaxed radix balanced tree (RRB-tree) of malValuePtr.
+//
+//  Leaves hold up to 32 items, branches up to 32 children. Every branch keeps
+//  a table of cumulative child sizes, so nodes need not be full: indexing
+//  guesses the child by radix and then steps forward over the size table.
+//  This relaxation is what allows concatenation and slicing in O(log n), as
+//  only the nodes along the seam or the cut need to be rebuilt.
+//
+//  RRBVector is a small value type; copying it shares the whole tree. It can
+//  also be updated in place, through the InPlace operations. These copy only
+//  the nodes which are shared with some other vector, and which owner hasn't
+//  already copied; owner is the transient doing the update, if there is one.
+
+class RRBNode : public RefCounted {
+public:
+    RRBNode(int height, int size, malOwner owner)
+    : m_height(height), m_size(size), m_owner(owner) { }
+
+    int height() const { return m_height; }
+    int size() const { return m_size; }
+    malOwner owner() const { return m_owner; }
+
+protected:
+    void setSize(int size) { m_size = size; }
+
+private:
+    const int       m_height;   // leaves are at height 0
+    int             m_size;     // number of items below this node
+    const malOwner  m_owner;
+};
+
+typedef RefCountedPtr<RRBNode> RRBNodePtr;
+
+class RRBVector {
+public:
+    class Iterator;
+
+    RRBVector();
+    RRBVector(malValueVec* items); // takes ownership of items
+    RRBVector(malValueIter begin, malValueIter end);
+
+    int count() const { return m_count; }
+    bool isEmpty() const { return m_count == 0; }
+    malValuePtr item(int index) const;
+
+    Iterator begin() const;
+    Iterator end() const;
+
+    RRBVector pushBack(malValuePtr value) const;
+    RRBVector pushFront(malValuePtr value) const;
+    RRBVector concat(const RRBVector& that) const;
+    RRBVector take(int count) const;
+    RRBVector drop(int count) const;
+
+    void pushBackInPlace(malValuePtr value, malOwner owner = NO_OWNER);
+    void pushFrontInPlace(malValuePtr value, malOwner owner = NO_OWNER);
+    void popFrontInPlace(malOwner owner = NO_OWNER);
+    void concatInPlace(const RRBVector& that, malOwner owner = NO_OWNER);
+
+    void getChildren(RefCountedVec& children) const {
+        children.push_back(m_root.ptr());
+    }
+
+private:
+    RRBVector(RRBNodePtr root);
+
+    void pushInPlace(malValuePtr value, bool atBack, malOwner owner);
+
+    friend class Iterator;
+    const malValueRef* leafFor(int index, int& leafStart, int& leafEnd) const;
+
+    RRBNodePtr m_root;
+    int        m_count;
+};
+
+class RRBVector::Iterator {
+public:
+    typedef std::forward_iterator_tag   iterator_category;
+    typedef malValuePtr                 value_type;
+    typedef int                         difference_type;
+#ifdef MAL_COMPRESSED_REFS
+    // An item is held compressed, so it can only be read as a copy.
+    typedef void                        pointer;
+    typedef malValuePtr                 reference;
+#else
+    typedef const malValuePtr*          pointer;
+    typedef const malValuePtr&          reference;
+#endif
+
+    Iterator(const RRBVector* vector, int index)
+    : m_vector(vector), m_index(index), m_leafStart(0), m_leafEnd(0) {
+        seek();
+    }
+
+    reference operator * () const { return m_items[m_index - m_leafStart]; }
+#ifndef MAL_COMPRESSED_REFS
+    pointer operator -> () const { return &**this; }
+#endif
+
+    Iterator& operator ++ () {
+        if (++m_index >= m_leafEnd) {
+            seek();
+        }
+        return *this;
+    }
+
+    Iterator operator + (int offset) const {
+        return Iterator(m_vector, m_index + offset);
+    }
+
+    int operator - (const Iterator& that) const {
+        return m_index - that.m_index;
+    }
+
+    bool operator == (const Iterator& that) const {
+        return m_index == that.m_index;
+    }
+
+    bool operator != (const Iterator& that) const {
+        return m_index != that.m_index;
+    }
+
+private:
+    void seek() {
+        if (m_index < m_vector->count()) {
+            m_items = m_vector->leafFor(m_index, m_leafStart, m_leafEnd);
+        }
+    }
+
+    const RRBVector*    m_vector;
+    int                 m_index;
+    int                 m_leafStart;
+    int                 m_leafEnd;
+    const malValueRef*  m_items;
+};
+
+inline RRBVector::Iterator RRBVector::begin() const
+{
+    return Iterator(this, 0);
+}
+
+inline RRBVector::Iterator RRBVector::end() const
+{
+    return Iterator(this, m_count);
+}
+
+#endif // INCLUDE_RRBVECTOR_H
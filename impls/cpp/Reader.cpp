@@ -6,11 +6,13 @@
 typedef std::regex              Regex;
 
 static const Regex intRegex("^[-+]?\\d+$");
+static const Regex doubleRegex("^[-+]?\\d+(\\.\\d*)?([eE][-+]?\\d+)?$");
 static const Regex closeRegex("[\\)\\]}]");
 
 static const Regex whitespaceRegex("[\\s,]+|;.*");
 static const Regex tokenRegexes[] = {
     Regex("~@"),
+    Regex("#\\{"),
     Regex("[\\[\\]{}()'`~^@]"),
     Regex("\"(?:\\\\.|[^\\\\\"])*\""),
     Regex("[^\\s\\[\\]{}('\"`,;)]+"),
@@ -153,6 +155,12 @@ static malValuePtr readForm(Tokeniser& tokeniser)
         readList(tokeniser, &items, "}");
         return mal::hash(items.begin(), items.end(), false);
     }
+    if (token == "#{") {
+        tokeniser.next();
+        malValueVec items;
+        readList(tokeniser, &items, "}");
+        return mal::set(items.begin(), items.end(), false);
+    }
     return readAtom(tokeniser);
 }
 
@@ -206,6 +214,9 @@ static malValuePtr readAtom(Tokeniser& tokeniser)
     if (std::regex_match(token, intRegex)) {
         return mal::integer(token);
     }
+    if (std::regex_match(token, doubleRegex)) {
+        return mal::real(token);
+    }
     return mal::symbol(token);
 }
 
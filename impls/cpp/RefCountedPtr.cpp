@@ -0,0 +1,388 @@
+#include "RefCountedPtr.h"
+#include "Nursery.h"
+#include "PointerSet.h"
+#include "Validation.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <new>
+
+size_t RefCounted::s_allocatedBytes = 0;
+size_t RefCounted::s_freedBytes = 0;
+size_t RefCounted::s_allocatedSinceCollection = 0;
+size_t RefCounted::s_collectionThreshold = 8 << 20;
+std::vector<RefCounted::Allocation>* RefCounted::s_deferredFrees = NULL;
+uint64_t RefCounted::s_collections = 0;
+uint64_t RefCounted::s_totalPauseMicros = 0;
+uint64_t RefCounted::s_longestPauseMicros = 0;
+size_t RefCounted::s_evaluationBudget = 0;
+size_t RefCounted::s_budget = 0;
+size_t RefCounted::s_chargedBytes = 0;
+size_t RefCounted::s_chargeLimit = SIZE_MAX;
+
+//  How much more may be allocated once a budget's been used up, so that the
+//  error can be handled.
+static const size_t BUDGET_HEADROOM = 64 << 10;
+
+//  The objects waiting to be deleted, as a stack, so that a structure is
+//  freed depth first. These are all plain data, with nothing to construct
+//  or destroy, so that objects may be released during static construction
+//  and destruction too.
+static const RefCounted** pending = NULL;
+static int pendingCount = 0;
+static int pendingCapacity = 0;
+static bool isDraining = false;
+static int deletesPerRelease = 0;
+
+//  The possible roots of garbage cycles: every object whose count has been
+//  decremented to something other than zero since the last collection. It's
+//  a hash set so that an object can be taken out of it cheaply when it's
+//  freed after all.
+static PointerSet roots;
+
+static void push(const RefCounted* object)
+{
+    if (pendingCount == pendingCapacity) {
+        int capacity = pendingCapacity == 0 ? 256 : pendingCapacity * 2;
+        void* grown = realloc(pending, capacity * sizeof *pending);
+        if (grown == NULL) {
+            throw std::bad_alloc();
+        }
+        pending = static_cast<const RefCounted**>(grown);
+        pendingCapacity = capacity;
+    }
+    pending[pendingCount++] = object;
+}
+
+void RefCounted::destroy(const RefCounted* object)
+{
+    if (object->m_word & BUFFERED) {
+        roots.remove(object);
+    }
+
+    // Only the outermost destroy deletes anything; the objects which that
+    // frees are queued for its loop.
+    if (isDraining) {
+        push(object);
+        return;
+    }
+    isDraining = true;
+    delete object;
+    isDraining = false;
+
+    // The object itself counts against the budget.
+    if (deletesPerRelease == 0) {
+        drainReleases(0);
+    }
+    else if (deletesPerRelease > 1) {
+        drainReleases(deletesPerRelease - 1);
+    }
+}
+
+void RefCounted::setReleaseBudget(int budget)
+{
+    deletesPerRelease = budget;
+}
+
+int RefCounted::releaseBudget()
+{
+    return deletesPerRelease;
+}
+
+int RefCounted::drainReleases(int budget)
+{
+    bool wasDraining = isDraining;
+    isDraining = true;
+    for (int deleted = 0;
+         pendingCount > 0 && (budget == 0 || deleted < budget); deleted++) {
+        delete pending[--pendingCount];
+    }
+    isDraining = wasDraining;
+    return pendingCount;
+}
+
+void RefCounted::possibleRoot() const
+{
+    m_word |= BUFFERED;
+    roots.insert(this);
+}
+
+size_t RefCounted::collectCycles()
+{
+    using namespace std::chrono;
+    steady_clock::time_point start = steady_clock::now();
+
+    s_allocatedSinceCollection = 0;
+    size_t reclaimed = runCollector();
+
+    // Let the live heap grow by half again before the next collection, so
+    // the time spent collecting stays in proportion to the time spent
+    // allocating.
+    size_t live = s_allocatedBytes - s_freedBytes;
+    size_t minimum = 8 << 20;
+    s_collectionThreshold = live / 2 > minimum ? live / 2 : minimum;
+
+    uint64_t pause = duration_cast<microseconds>(
+        steady_clock::now() - start).count();
+    s_collections++;
+    s_totalPauseMicros += pause;
+    if (pause > s_longestPauseMicros) {
+        s_longestPauseMicros = pause;
+    }
+    return reclaimed;
+}
+
+RefCounted::AllocationBudget::AllocationBudget(size_t bytes)
+: m_outerLimit(s_chargeLimit)
+, m_outerBudget(s_budget)
+{
+    if (bytes != 0 && s_chargedBytes + bytes < s_chargeLimit) {
+        s_chargeLimit = s_chargedBytes + bytes;
+        s_budget = bytes;
+    }
+}
+
+RefCounted::AllocationBudget::~AllocationBudget()
+{
+    s_chargeLimit = m_outerLimit;
+    s_budget = m_outerBudget;
+}
+
+void RefCounted::overBudget()
+{
+    s_chargeLimit = s_chargedBytes + BUDGET_HEADROOM;
+    MAL_FAIL("Allocation budget of %zu bytes exceeded", s_budget);
+}
+
+#ifndef MAL_TRACING_GC
+
+void* RefCounted::operator new(size_t size)
+{
+    chargeBudget(size);
+    s_allocatedBytes += size;
+    s_allocatedSinceCollection += size;
+    if (void* object = Nursery::allocate(size)) {
+        return object;
+    }
+#ifdef MAL_COMPRESSED_REFS
+    // Anything outside the Nursery couldn't be referred to compressed.
+    throw std::bad_alloc();
+#else
+    return ::operator new(size);
+#endif
+}
+
+static void deallocate(void* object, size_t size)
+{
+    if (!Nursery::free(object, size)) {
+        ::operator delete(object);
+    }
+}
+
+void RefCounted::operator delete(void* object, size_t size)
+{
+    s_freedBytes += size;
+    if (s_deferredFrees != NULL) {
+        s_deferredFrees->push_back(Allocation(object, size));
+        return;
+    }
+    deallocate(object, size);
+}
+
+//  Trial deletion, after Bacon and Rajan's synchronous collector. Starting
+//  from the possible roots, every count is decremented once for each
+//  reference from within the subgraph they reach; whatever is left with a
+//  count of zero is referred to only from within that subgraph, and what
+//  can't be reached from something with a count left over is garbage.
+//  Each pass keeps its own stack, so a long chain doesn't recurse.
+
+class CycleCollector {
+public:
+    size_t collect();
+
+private:
+    enum Color { BLACK, GRAY, WHITE };
+
+    static Color color(const RefCounted* object) {
+        return static_cast<Color>((object->m_word & RefCounted::COLOR_MASK)
+                                  >> RefCounted::COLOR_SHIFT);
+    }
+    static void setColor(const RefCounted* object, Color color) {
+        object->m_word = (object->m_word & ~RefCounted::COLOR_MASK)
+                       | (color << RefCounted::COLOR_SHIFT);
+    }
+    static bool isTraced(const RefCounted* object) {
+        return object != NULL && !(object->m_word
+                            & (RefCounted::IMMORTAL | RefCounted::ACYCLIC));
+    }
+
+    void markGray(const RefCounted* root);
+    void scan(const RefCounted* root);
+    void scanBlack(const RefCounted* root);
+    void collectWhite(const RefCounted* root);
+
+    // Fills m_children with the traced children of object.
+    void children(const RefCounted* object);
+
+    RefCountedVec m_stack;
+    RefCountedVec m_children;
+    RefCountedVec m_garbage;
+};
+
+void CycleCollector::children(const RefCounted* object)
+{
+    m_children.clear();
+    object->getChildren(m_children);
+    size_t kept = 0;
+    for (size_t i = 0; i < m_children.size(); i++) {
+        if (isTraced(m_children[i])) {
+            m_children[kept++] = m_children[i];
+        }
+    }
+    m_children.resize(kept);
+}
+
+void CycleCollector::markGray(const RefCounted* root)
+{
+    if (color(root) == GRAY) {
+        return;
+    }
+    setColor(root, GRAY);
+    m_stack.push_back(root);
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        children(object);
+        for (size_t i = 0; i < m_children.size(); i++) {
+            const RefCounted* child = m_children[i];
+            child->m_word -= RefCounted::ONE;
+            if (color(child) != GRAY) {
+                setColor(child, GRAY);
+                m_stack.push_back(child);
+            }
+        }
+    }
+}
+
+void CycleCollector::scan(const RefCounted* root)
+{
+    m_stack.push_back(root);
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        if (color(object) != GRAY) {
+            continue;
+        }
+        if (object->refCount() > 0) {
+            scanBlack(object);
+            continue;
+        }
+        setColor(object, WHITE);
+        children(object);
+        m_stack.insert(m_stack.end(), m_children.begin(), m_children.end());
+    }
+}
+
+void CycleCollector::scanBlack(const RefCounted* root)
+{
+    // scan's own stack is left underneath this one.
+    size_t base = m_stack.size();
+    setColor(root, BLACK);
+    m_stack.push_back(root);
+    while (m_stack.size() > base) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        children(object);
+        for (size_t i = 0; i < m_children.size(); i++) {
+            const RefCounted* child = m_children[i];
+            child->m_word += RefCounted::ONE;
+            if (color(child) != BLACK) {
+                setColor(child, BLACK);
+                m_stack.push_back(child);
+            }
+        }
+    }
+}
+
+void CycleCollector::collectWhite(const RefCounted* root)
+{
+    m_stack.push_back(root);
+    while (!m_stack.empty()) {
+        const RefCounted* object = m_stack.back();
+        m_stack.pop_back();
+        if (color(object) != WHITE || (object->m_word & RefCounted::BUFFERED)) {
+            continue;
+        }
+        setColor(object, BLACK);
+        m_garbage.push_back(object);
+        children(object);
+        m_stack.insert(m_stack.end(), m_children.begin(), m_children.end());
+    }
+}
+
+size_t CycleCollector::collect()
+{
+    RefCountedVec candidates;
+    for (size_t i = 0; i < roots.capacity; i++) {
+        if (roots.slots[i] == NULL) {
+            continue;
+        }
+        const RefCounted* object =
+            static_cast<const RefCounted*>(roots.slots[i]);
+        if (isTraced(object)) {
+            candidates.push_back(object);
+        }
+        else {
+            // Made immortal since it was buffered.
+            object->m_word &= ~RefCounted::BUFFERED;
+        }
+    }
+    roots.clear();
+
+    for (size_t i = 0; i < candidates.size(); i++) {
+        markGray(candidates[i]);
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+        scan(candidates[i]);
+    }
+    for (size_t i = 0; i < candidates.size(); i++) {
+        candidates[i]->m_word &= ~RefCounted::BUFFERED;
+        collectWhite(candidates[i]);
+    }
+
+    // The references between garbage objects were uncounted by markGray;
+    // put them back, so that whatever the garbage refers to outside itself
+    // is released normally as it's deleted. Meanwhile, making the garbage
+    // immortal stops the references within it from freeing it twice, and
+    // deferring the frees lets those references be released after the
+    // objects they refer to have been destroyed.
+    for (size_t i = 0; i < m_garbage.size(); i++) {
+        children(m_garbage[i]);
+        for (size_t j = 0; j < m_children.size(); j++) {
+            m_children[j]->m_word += RefCounted::ONE;
+        }
+    }
+    for (size_t i = 0; i < m_garbage.size(); i++) {
+        m_garbage[i]->makeImmortal();
+    }
+
+    size_t freedBefore = RefCounted::freedBytes();
+    std::vector<RefCounted::Allocation> deferred;
+    RefCounted::s_deferredFrees = &deferred;
+    for (size_t i = 0; i < m_garbage.size(); i++) {
+        RefCounted::destroy(m_garbage[i]);
+    }
+    RefCounted::s_deferredFrees = NULL;
+    for (size_t i = 0; i < deferred.size(); i++) {
+        deallocate(deferred[i].first, deferred[i].second);
+    }
+    return RefCounted::freedBytes() - freedBefore;
+}
+
+size_t RefCounted::runCollector()
+{
+    CycleCollector collector;
+    return collector.collect();
+}
+
+#endif // MAL_TRACING_GC
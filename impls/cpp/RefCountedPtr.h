@@ -2,23 +2,260 @@
 #define INCLUDE_REFCOUNTEDPTR_H
 
 #include "Debug.h"
+#include "MemoryStats.h"
 
 #include <cstddef>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+class RefCounted;
+typedef std::vector<const RefCounted*> RefCountedVec;
+
+//  The count shares a word with the flags the cycle collector needs, so
+//  an object costs no more than it did with a bare count.
+//
+//  An immortal object is never deleted, and acquire and release leave its
+//  count alone, so that the objects which everything refers to (nil, true,
+//  false and the builtins) aren't written to each time they're used.
+//
+//  An acyclic object can't refer, however indirectly, back to itself (a
+//  number, a string), so the cycle collector never looks at it.
+//
+//  Built with MAL_TRACING_GC defined (make GC=tracing), nothing is counted
+//  at all: a mark-sweep collector frees whatever it can't reach from the
+//  immortal objects, the C++ stack and the buffers of temporary value
+//  vectors. See MarkSweep.cpp.
 
 class RefCounted {
 public:
-    RefCounted() : m_refCount(0) { }
+    RefCounted() : m_word(0) { }
     virtual ~RefCounted() { }
 
-    const RefCounted* acquire() const { m_refCount++; return this; }
-    int release() const { return --m_refCount; }
-    int refCount() const { return m_refCount; }
+#ifdef MAL_TRACING_GC
+    const RefCounted* acquire() const { return this; }
+    bool release() const { return false; }
+
+    // Nothing knows whether it's shared, so nothing is updated in place.
+    int refCount() const { return 2; }
+#else
+    const RefCounted* acquire() const {
+        if (!(m_word & IMMORTAL)) {
+            m_word += ONE;
+            if (m_word >= SATURATED) {
+                makeImmortal();
+            }
+        }
+        return this;
+    }
+
+    // Returns true if that was the last reference. Otherwise the object
+    // may now be garbage kept alive only by a cycle, so it's remembered
+    // for the next collection.
+    bool release() const {
+        if (m_word & IMMORTAL) {
+            return false;
+        }
+        m_word -= ONE;
+        if (m_word < ONE) {
+            return true;
+        }
+        if (!(m_word & (ACYCLIC | BUFFERED))) {
+            possibleRoot();
+        }
+        return false;
+    }
+    int refCount() const { return m_word >> COUNT_SHIFT; }
+#endif
+
+    bool isImmortal() const { return (m_word & IMMORTAL) != 0; }
+    void makeImmortal() const { m_word |= IMMORTAL | COUNT_MASK; }
+
+    // Appends the objects this one holds a counted reference to (NULLs are
+    // skipped). Listing one it holds no count on would free it early, and
+    // so, when tracing, would leaving one out.
+    // The collector calls this mid-collection, so it mustn't acquire or
+    // release anything.
+    virtual void getChildren(RefCountedVec& children) const { }
+
+    // Deletes an object whose count has reached zero. The objects it frees
+    // in turn are queued rather than deleted from within its destructor,
+    // so freeing a deep structure doesn't recurse.
+    static void destroy(const RefCounted* object);
+
+    // Limits how many queued objects each destroy deletes, so that freeing
+    // a large structure is spread over later releases rather than taking
+    // one long pause. 0, the default, means no limit.
+    static void setReleaseBudget(int budget);
+    static int releaseBudget();
+
+    // Deletes up to budget (or, if 0, all) of the queued objects, and
+    // returns how many are left. The evaluator drains a release budget's
+    // worth at each step, so that the queue empties even while little is
+    // being released.
+    static int drainReleases(int budget = 0);
+
+    // True once enough has been allocated since the last collection that
+    // another is worth its cost. The evaluator checks this at a point
+    // where it holds no raw pointers to anything that might be freed.
+    static bool isCollectionDue() {
+        return s_allocatedSinceCollection >= s_collectionThreshold;
+    }
+
+    // Frees the garbage cycles among the objects released since the last
+    // collection (or, when tracing, all the garbage), and returns the number
+    // of bytes that reclaimed.
+    static size_t collectCycles();
+
+    // Totals, in bytes, over the life of the process.
+    static size_t allocatedBytes() { return s_allocatedBytes; }
+    static size_t freedBytes() { return s_freedBytes; }
+
+    // How many collections there have been, and how long they took.
+    static uint64_t collections() { return s_collections; }
+    static uint64_t totalPauseMicros() { return s_totalPauseMicros; }
+    static uint64_t longestPauseMicros() { return s_longestPauseMicros; }
+
+    // Limits what may be allocated, in objects and value vector buffers,
+    // while it's in scope: going over throws a MAL error. There's then a
+    // little more room, so that whatever catches the error can run, and
+    // going over that throws again. An enclosing budget still applies, so
+    // one can't be used to get more room than there is.
+    class AllocationBudget {
+    public:
+        // 0 means no limit of its own.
+        explicit AllocationBudget(size_t bytes);
+        ~AllocationBudget();
+
+    private:
+        size_t m_outerLimit;
+        size_t m_outerBudget;
+    };
+
+    // What each top-level evaluation, and each call to eval, may allocate,
+    // or 0 for no limit (the default).
+    static size_t evaluationBudget() { return s_evaluationBudget; }
+    static void setEvaluationBudget(size_t bytes) {
+        s_evaluationBudget = bytes;
+    }
+
+    // Counts size towards the current budget, throwing if it's used up.
+    static void chargeBudget(size_t size) {
+        s_chargedBytes += size;
+        if (s_chargedBytes > s_chargeLimit) {
+            overBudget();
+        }
+    }
+
+#ifdef MAL_TRACING_GC
+    // The buffer of the value vector this object owns, if any. It's traced
+    // through getChildren, unlike those of temporaries, which are roots.
+    virtual const void* ownedBuffer() const { return NULL; }
+
+    // For BufferAllocator.
+    static void* allocateBuffer(size_t size);
+    static void freeBuffer(void* buffer);
+
+    // Counts memory held outside the heap (an int-vector's items) towards
+    // the next collection, so that garbage holding a lot of it isn't kept
+    // for long.
+    static void noteExternalBytes(size_t size) {
+        s_allocatedSinceCollection += size;
+    }
+#endif
+
+    // Small objects come from the Nursery, unless tracing.
+    static void* operator new(size_t size);
+    static void operator delete(void* object, size_t size);
+
+protected:
+    // Called by the constructors of types which can't be part of a cycle.
+    void makeAcyclic() { m_word |= ACYCLIC; }
 
 private:
+    // The flags take the low bits; the count is what's left above them.
+    enum {
+        IMMORTAL = 1 << 0,
+        ACYCLIC  = 1 << 1,
+        BUFFERED = 1 << 2,
+        MARKED   = 1 << 2,  // for the tracing collector, which buffers none
+        COLOR_SHIFT = 3,
+        COLOR_MASK = 3 << COLOR_SHIFT,
+        COUNT_SHIFT = 5,
+    };
+    static const unsigned ONE = 1u << COUNT_SHIFT;
+    static const unsigned COUNT_MASK = ~0u << COUNT_SHIFT;
+    static const unsigned SATURATED = COUNT_MASK - ONE;
+
+    friend class CycleCollector;
+    friend class MarkSweep;
+
+    void possibleRoot() const;
+    static void overBudget();
+
+    // The collector for this build, called by collectCycles.
+    static size_t runCollector();
+
     RefCounted(const RefCounted&); // no copy ctor
     RefCounted& operator = (const RefCounted&); // no assignments
 
-    mutable int m_refCount;
+    mutable unsigned m_word;
+
+    static size_t s_allocatedBytes;
+    static size_t s_freedBytes;
+    static size_t s_allocatedSinceCollection;
+    static size_t s_collectionThreshold;
+
+    // While the collector deletes a cycle, the memory of each object in it
+    // is kept until they've all been destroyed, as the others still
+    // release their references to it.
+    typedef std::pair<void*, size_t> Allocation;
+    static std::vector<Allocation>* s_deferredFrees;
+
+    static uint64_t s_collections;
+    static uint64_t s_totalPauseMicros;
+    static uint64_t s_longestPauseMicros;
+
+    static size_t s_evaluationBudget;
+    static size_t s_budget;         // that of the innermost budget, or 0
+    static size_t s_chargedBytes;
+    static size_t s_chargeLimit;
+};
+
+//  The allocator of value vectors, which counts their buffers and, when
+//  tracing, keeps track of them so that the collector can scan those of
+//  temporaries for roots.
+template<class T>
+struct BufferAllocator {
+    typedef T value_type;
+
+    BufferAllocator() { }
+    template<class U> BufferAllocator(const BufferAllocator<U>&) { }
+
+    T* allocate(size_t n) {
+        RefCounted::chargeBudget(n * sizeof(T));
+        LiveCount::valueBuffers.add(n * sizeof(T));
+#ifdef MAL_TRACING_GC
+        return static_cast<T*>(RefCounted::allocateBuffer(n * sizeof(T)));
+#else
+        return static_cast<T*>(::operator new(n * sizeof(T)));
+#endif
+    }
+    void deallocate(T* buffer, size_t n) {
+        LiveCount::valueBuffers.remove(n * sizeof(T));
+#ifdef MAL_TRACING_GC
+        RefCounted::freeBuffer(buffer);
+#else
+        ::operator delete(buffer);
+#endif
+    }
+
+    template<class U> bool operator == (const BufferAllocator<U>&) const {
+        return true;
+    }
+    template<class U> bool operator != (const BufferAllocator<U>&) const {
+        return false;
+    }
 };
 
 template<class T>
@@ -66,8 +303,8 @@ private:
     }
 
     void release() {
-        if ((m_object != NULL) && (m_object->release() == 0)) {
-            delete m_object;
+        if ((m_object != NULL) && m_object->release()) {
+            RefCounted::destroy(m_object);
         }
     }
 
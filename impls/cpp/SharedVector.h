@@ -0,0 +1,42 @@
+#ifndef INCLUDE_SHAREDVECTOR_H
+#define INCLUDE_SHAREDVECTOR_H
+
+#include "RefCountedPtr.h"
+
+#include <vector>
+
+//  An immutable vector, which copies share rather than duplicate, so that
+//  copying a value holding one (as with-meta does) takes the same time
+//  however many items it has.
+
+template<typename T>
+class SharedVector
+{
+public:
+    typedef std::vector<T> Items;
+
+    // Takes the items, leaving the argument empty.
+    explicit SharedVector(Items& items) : m_box(new Box) {
+        m_box->items.swap(items);
+#ifdef MAL_TRACING_GC
+        RefCounted::noteExternalBytes(m_box->items.size() * sizeof(T));
+#endif
+    }
+
+    const Items& operator * () const { return m_box->items; }
+    const Items* operator -> () const { return &m_box->items; }
+
+    void getChildren(RefCountedVec& children) const {
+        children.push_back(m_box.ptr());
+    }
+
+private:
+    struct Box : public RefCounted {
+        Box() { makeAcyclic(); }
+        Items items;
+    };
+
+    RefCountedPtr<Box> m_box;
+};
+
+#endif // INCLUDE_SHAREDVECTOR_H
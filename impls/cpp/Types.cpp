@@ -3,8 +3,49 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
 #include <memory>
 #include <typeinfo>
+#include <unordered_map>
+
+COUNT_LIVE(malConstant);
+COUNT_LIVE(malInteger);
+COUNT_LIVE(malBigInteger);
+COUNT_LIVE(malDouble);
+COUNT_LIVE(malString);
+COUNT_LIVE(malKeyword);
+COUNT_LIVE(malSymbol);
+COUNT_LIVE(malList);
+COUNT_LIVE(malVector);
+COUNT_LIVE(malIntVector);
+COUNT_LIVE(malHash);
+COUNT_LIVE(malSortedMap);
+COUNT_LIVE(RecordLayout);
+COUNT_LIVE(malRecord);
+COUNT_LIVE(malRecordType);
+COUNT_LIVE(malHashSet);
+COUNT_LIVE(malSortedSet);
+COUNT_LIVE(malBuiltIn);
+COUNT_LIVE(malLambda);
+COUNT_LIVE(malAtom);
+COUNT_LIVE(malTransientVector);
+COUNT_LIVE(malTransientHash);
+COUNT_LIVE(malTransientSet);
+
+static malValue* makeConstant(const char* name)
+{
+    malValue* constant = new malConstant(name);
+    constant->makeImmortal();
+    return constant;
+}
+
+malValue* const malNil   = makeConstant("nil");
+malValue* const malTrue  = makeConstant("true");
+malValue* const malFalse = makeConstant("false");
 
 namespace mal {
     malValuePtr atom(malValuePtr value) {
@@ -19,13 +60,8 @@ namespace mal {
         return malValuePtr(new malBuiltIn(name, handler));
     };
 
-    malValuePtr falseValue() {
-        static malValuePtr c(new malConstant("false"));
-        return malValuePtr(c);
-    };
-
 
-    malValuePtr hash(const malHash::Map& map) {
+    malValuePtr hash(const HAMT& map) {
         return malValuePtr(new malHash(map));
     }
 
@@ -38,19 +74,34 @@ namespace mal {
         return malValuePtr(new malInteger(value));
     };
 
+    malValuePtr integer(const BigInteger& value) {
+        return value.fitsInt64() ? integer(value.toInt64())
+                                 : malValuePtr(new malBigInteger(value));
+    };
+
     malValuePtr integer(const String& token) {
-        return integer(std::stoi(token));
+        errno = 0;
+        int64_t value = strtoll(token.c_str(), NULL, 10);
+        return errno != ERANGE ? integer(value) : integer(BigInteger(token));
+    };
+
+    malValuePtr intVector(malIntVec* items) {
+        return malValuePtr(new malIntVector(items));
     };
 
     malValuePtr keyword(const String& token) {
         return malValuePtr(new malKeyword(token));
     };
 
-    malValuePtr lambda(const StringVec& bindings,
+    malValuePtr lambda(StringVec& bindings,
                        malValuePtr body, malEnvPtr env) {
         return malValuePtr(new malLambda(bindings, body, env));
     }
 
+    malValuePtr lambda(malScopePtr scope, malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(scope, body, env));
+    }
+
     malValuePtr list(malValueVec* items) {
         return malValuePtr(new malList(items));
     };
@@ -59,6 +110,10 @@ namespace mal {
         return malValuePtr(new malList(begin, end));
     };
 
+    malValuePtr list(const RRBVector& items) {
+        return malValuePtr(new malList(items));
+    };
+
     malValuePtr list(malValuePtr a) {
         malValueVec* items = new malValueVec(1);
         items->at(0) = a;
@@ -84,10 +139,32 @@ namespace mal {
         return malValuePtr(new malLambda(lambda, true));
     };
 
-    malValuePtr nilValue() {
-        static malValuePtr c(new malConstant("nil"));
-        return malValuePtr(c);
-    };
+    malValuePtr real(double value) {
+        return malValuePtr(new malDouble(value));
+    }
+
+    malValuePtr real(const String& token) {
+        // Not stod, which throws when the value is out of range or even
+        // subnormal, rather than giving the infinity, zero or subnormal.
+        return real(strtod(token.c_str(), NULL));
+    }
+
+    malValuePtr set(malValueIter argsBegin, malValueIter argsEnd,
+                    bool isEvaluated) {
+        return malValuePtr(new malHashSet(argsBegin, argsEnd, isEvaluated));
+    }
+
+    malValuePtr set(const HAMT& items) {
+        return malValuePtr(new malHashSet(items));
+    }
+
+    malValuePtr sortedMap(const AVLTree& map) {
+        return malValuePtr(new malSortedMap(map));
+    }
+
+    malValuePtr sortedSet(const AVLTree& items) {
+        return malValuePtr(new malSortedSet(items));
+    }
 
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
@@ -97,11 +174,6 @@ namespace mal {
         return malValuePtr(new malSymbol(token));
     };
 
-    malValuePtr trueValue() {
-        static malValuePtr c(new malConstant("true"));
-        return malValuePtr(c);
-    };
-
     malValuePtr vector(malValueVec* items) {
         return malValuePtr(new malVector(items));
     };
@@ -109,44 +181,77 @@ namespace mal {
     malValuePtr vector(malValueIter begin, malValueIter end) {
         return malValuePtr(new malVector(begin, end));
     };
+
+    malValuePtr vector(const RRBVector& items) {
+        return malValuePtr(new malVector(items));
+    };
+
+    malValuePtr vector(malValuePtr a, malValuePtr b) {
+        malValueVec* items = new malValueVec(2);
+        items->at(0) = a;
+        items->at(1) = b;
+        return malValuePtr(new malVector(items));
+    }
 };
 
+// Owners are never reused, so that a frozen transient's nodes stay frozen.
+// (Wrapping around would take four billion transients.)
+static malOwner lastOwner = NO_OWNER;
+
+malOwner newOwner()
+{
+    if (++lastOwner == NO_OWNER) {
+        ++lastOwner;
+    }
+    return lastOwner;
+}
+
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
     return m_handler(m_name, argsBegin, argsEnd);
 }
 
-static String makeHashKey(malValuePtr key)
+// The finalising mix from MurmurHash3, to spread bits across the hash.
+static uint32_t mixHash(uint32_t hash)
 {
-    if (const malString* skey = DYNAMIC_CAST(malString, key)) {
-        return skey->print(true);
-    }
-    else if (const malKeyword* kkey = DYNAMIC_CAST(malKeyword, key)) {
-        return kkey->print(true);
-    }
-    MAL_FAIL("%s is not a string or keyword", key->print(true).c_str());
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static uint32_t combineHash(uint32_t seed, uint32_t hash)
+{
+    return seed ^ (hash + 0x9e3779b9 + (seed << 6) + (seed >> 2));
+}
+
+static uint32_t hashWord(uint64_t word)
+{
+    return mixHash(static_cast<uint32_t>(word ^ (word >> 32)));
 }
 
-static malHash::Map addToMap(malHash::Map& map,
+static HAMT addToMap(const HAMT& map,
     malValueIter argsBegin, malValueIter argsEnd)
 {
     // This is intended to be called with pre-evaluated arguments.
+    HAMT result = map;
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it++);
-        map[key] = *it;
+        malValuePtr key = *it++;
+        result = result.assoc(key, *it);
     }
 
-    return map;
+    return result;
 }
 
-static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
+static HAMT createMap(malValueIter argsBegin, malValueIter argsEnd)
 {
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "hash-map requires an even-sized list");
 
-    malHash::Map map;
-    return addToMap(map, argsBegin, argsEnd);
+    return addToMap(HAMT(), argsBegin, argsEnd);
 }
 
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
@@ -156,7 +261,7 @@ malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
 
 }
 
-malHash::malHash(const malHash::Map& map)
+malHash::malHash(const HAMT& map)
 : m_map(map)
 , m_isEvaluated(true)
 {
@@ -169,322 +274,1391 @@ malHash::assoc(malValueIter argsBegin, malValueIter argsEnd) const
     MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
             "assoc requires an even-sized list");
 
-    malHash::Map map(m_map);
-    return mal::hash(addToMap(map, argsBegin, argsEnd));
-}
-
-bool malHash::contains(malValuePtr key) const
-{
-    auto it = m_map.find(makeHashKey(key));
-    return it != m_map.end();
+    return mal::hash(addToMap(m_map, argsBegin, argsEnd));
 }
 
 malValuePtr
 malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    malHash::Map map(m_map);
+    HAMT map = m_map;
     for (auto it = argsBegin; it != argsEnd; ++it) {
-        String key = makeHashKey(*it);
-        map.erase(key);
+        map = map.dissoc(*it);
     }
     return mal::hash(map);
 }
 
-malValuePtr malHash::eval(malEnvPtr env)
+void malHash::assocInPlace(malValueIter argsBegin, malValueIter argsEnd)
 {
-    if (m_isEvaluated) {
-        return malValuePtr(this);
-    }
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
 
-    malHash::Map map;
-    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        map[it->first] = EVAL(it->second, env);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        malValuePtr key = *it++;
+        m_map.assocInPlace(key, *it);
     }
-    return mal::hash(map);
+    m_isEvaluated = true;
+    reset();
 }
 
-malValuePtr malHash::get(malValuePtr key) const
+void malHash::dissocInPlace(malValueIter argsBegin, malValueIter argsEnd)
 {
-    auto it = m_map.find(makeHashKey(key));
-    return it == m_map.end() ? mal::nilValue() : it->second;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.dissocInPlace(*it);
+    }
+    m_isEvaluated = true;
+    reset();
 }
 
-malValuePtr malHash::keys() const
+malValuePtr malHash::eval(malEnvPtr env)
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
+    if (m_isEvaluated) {
+        return malValuePtr(this);
+    }
+
+    HAMT map;
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        if (it->first[0] == '"') {
-            keys->push_back(mal::string(unescape(it->first)));
-        }
-        else {
-            keys->push_back(mal::keyword(it->first));
-        }
+        map = map.assoc(EVAL(it->key, env), EVAL(it->value, env));
     }
-    return mal::list(keys);
+    return mal::hash(map);
 }
 
-malValuePtr malHash::values() const
+bool malHash::forEach(const Visitor& visit) const
 {
-    malValueVec* keys = new malValueVec();
-    keys->reserve(m_map.size());
     for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
-        keys->push_back(it->second);
+        if (!visit(it->key, it->value)) {
+            return false;
+        }
     }
-    return mal::list(keys);
+    return true;
 }
 
-String malHash::print(bool readably) const
+malValuePtr
+malSortedMap::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    String s = "{";
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
 
-    auto it = m_map.begin(), end = m_map.end();
-    if (it != end) {
-        s += it->first + " " + it->second->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        s += " " + it->first + " " + it->second->print(readably);
+    AVLTree map = m_map;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        malValuePtr key = *it++;
+        map = map.assoc(key, *it);
     }
-
-    return s + "}";
+    return mal::sortedMap(map);
 }
 
-bool malHash::doIsEqualTo(const malValue* rhs) const
+malValuePtr
+malSortedMap::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    const malHash::Map& r_map = static_cast<const malHash*>(rhs)->m_map;
-    if (m_map.size() != r_map.size()) {
-        return false;
+    AVLTree map = m_map;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        map = map.dissoc(*it);
     }
+    return mal::sortedMap(map);
+}
 
-    for (auto it0 = m_map.begin(), end0 = m_map.end(), it1 = r_map.begin();
-         it0 != end0; ++it0, ++it1) {
-
-        if (it0->first != it1->first) {
-            return false;
-        }
-        if (!it0->second->isEqualTo(it1->second.ptr())) {
+bool malSortedMap::forEach(const Visitor& visit) const
+{
+    for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+        if (!visit(it->key(), it->value())) {
             return false;
         }
     }
     return true;
 }
 
-malLambda::malLambda(const StringVec& bindings,
-                     malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
-, m_body(body)
-, m_env(env)
-, m_isMacro(false)
+RecordLayout::RecordLayout(const String& name, malValueVec& fields)
+: m_name(name)
 {
-
+    makeAcyclic();
+    m_fields.swap(fields);
+    for (int i = 0, count = m_fields.size(); i < count; i++) {
+        MAL_CHECK(!m_slots.find(m_fields[i]), "Duplicate field %s in %s",
+                  m_fields[i]->print(true).c_str(), m_name.c_str());
+        m_slots.assocInPlace(m_fields[i], mal::integer(i));
+    }
 }
 
-malLambda::malLambda(const malLambda& that, malValuePtr meta)
-: malApplicable(meta)
-, m_bindings(that.m_bindings)
-, m_body(that.m_body)
-, m_env(that.m_env)
-, m_isMacro(that.m_isMacro)
+int RecordLayout::slot(malValuePtr key) const
 {
-
+    const malValueRef* slot = m_slots.find(key);
+    return slot ? STATIC_CAST(malInteger, *slot)->value() : -1;
 }
 
-malLambda::malLambda(const malLambda& that, bool isMacro)
-: malApplicable(that.m_meta)
-, m_bindings(that.m_bindings)
-, m_body(that.m_body)
-, m_env(that.m_env)
-, m_isMacro(isMacro)
+void RecordLayout::getChildren(RefCountedVec& children) const
 {
-
+    for (auto it = m_fields.begin(); it != m_fields.end(); ++it) {
+        children.push_back(it->ptr());
+    }
+    m_slots.getChildren(children);
 }
 
-malValuePtr malLambda::apply(malValueIter argsBegin,
-                             malValueIter argsEnd) const
+malRecord::malRecord(RecordLayoutPtr layout,
+                     malValueVec* slots, const HAMT& extras)
+: m_layout(layout)
+, m_extras(extras)
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    moveItems(*slots, m_slots);
+    delete slots;
 }
 
-malValuePtr malLambda::doWithMeta(malValuePtr meta) const
+void malRecord::getChildren(RefCountedVec& children) const
 {
-    return new malLambda(*this, meta);
+    malValue::getChildren(children);
+    children.push_back(m_layout.ptr());
+    for (auto it = m_slots.begin(); it != m_slots.end(); ++it) {
+        children.push_back(it->ptr());
+    }
+    m_extras.getChildren(children);
 }
 
-malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
+const malValueRef* malRecord::find(malValuePtr key) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    int slot = m_layout->slot(key);
+    return slot >= 0 ? &m_slots[slot] : m_extras.find(key);
 }
 
-malValuePtr malList::conj(malValueIter argsBegin,
-                          malValueIter argsEnd) const
+malValuePtr
+malRecord::assoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::reverse_copy(argsBegin, argsEnd, items->begin());
-    std::copy(begin(), end(), items->begin() + newItemCount);
+    malRecord* record = new malRecord(m_layout, new malValueVec(m_slots.begin(), m_slots.end()),
+                                      m_extras);
+    malValuePtr result(record);
+    record->assocInPlace(argsBegin, argsEnd);
+    return result;
+}
 
-    return mal::list(items);
+void malRecord::assocInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        malValuePtr key = *it++;
+        int slot = m_layout->slot(key);
+        if (slot >= 0) {
+            m_slots[slot] = *it;
+        }
+        else {
+            m_extras.assocInPlace(key, *it);
+        }
+    }
+    reset();
 }
 
-malValuePtr malList::eval(malEnvPtr env)
+malValuePtr
+malRecord::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    // Note, this isn't actually called since the TCO updates, but
-    // is required for the earlier steps, so don't get rid of it.
-    if (count() == 0) {
-        return malValuePtr(this);
+    bool keepsFields = true;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        keepsFields = keepsFields && m_layout->slot(*it) < 0;
+    }
+    if (keepsFields) {
+        HAMT extras = m_extras;
+        for (auto it = argsBegin; it != argsEnd; ++it) {
+            extras.dissocInPlace(*it);
+        }
+        return new malRecord(m_layout, new malValueVec(m_slots.begin(), m_slots.end()), extras);
     }
 
-    std::unique_ptr<malValueVec> items(evalItems(env));
-    auto it = items->begin();
-    malValuePtr op = *it;
-    return APPLY(op, ++it, items->end());
+    HAMT map = m_extras;
+    for (int i = 0, count = m_slots.size(); i < count; i++) {
+        map.assocInPlace(m_layout->field(i), m_slots[i]);
+    }
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        map.dissocInPlace(*it);
+    }
+    return mal::hash(map);
 }
 
-String malList::print(bool readably) const
+bool malRecord::forEach(const Visitor& visit) const
 {
-    return '(' + malSequence::print(readably) + ')';
+    for (int i = 0, count = m_slots.size(); i < count; i++) {
+        if (!visit(m_layout->field(i), m_slots[i])) {
+            return false;
+        }
+    }
+    for (auto it = m_extras.begin(), end = m_extras.end(); it != end; ++it) {
+        if (!visit(it->key, it->value)) {
+            return false;
+        }
+    }
+    return true;
 }
 
-malValuePtr malValue::eval(malEnvPtr env)
+String malRecord::print(bool readably) const
 {
-    // Default case of eval is just to return the object itself.
-    return malValuePtr(this);
+    return "#" + m_layout->name() + malMap::print(readably);
 }
 
-bool malValue::isEqualTo(const malValue* rhs) const
+malValuePtr
+malRecordType::apply(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    // Special-case. Vectors and Lists can be compared.
-    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
-        (dynamic_cast<const malSequence*>(this) &&
-         dynamic_cast<const malSequence*>(rhs));
+    int argCount = std::distance(argsBegin, argsEnd);
+    MAL_CHECK(argCount == m_layout->fieldCount(),
+              "%s takes %d fields, not %d", m_layout->name().c_str(),
+              m_layout->fieldCount(), argCount);
 
-    return matchingTypes && doIsEqualTo(rhs);
+    return new malRecord(m_layout, new malValueVec(argsBegin, argsEnd),
+                         HAMT());
 }
 
-bool malValue::isTrue() const
+malValuePtr malRecordType::fromMap(const malMap* map) const
 {
-    return (this != mal::falseValue().ptr())
-        && (this != mal::nilValue().ptr());
+    malValueVec* slots = new malValueVec(m_layout->fieldCount(),
+                                         mal::nilValue());
+    HAMT extras;
+    map->forEach([this, slots, &extras](const malValuePtr& key,
+                                        const malValuePtr& value) {
+        int slot = m_layout->slot(key);
+        if (slot >= 0) {
+            slots->at(slot) = value;
+        }
+        else {
+            extras.assocInPlace(key, value);
+        }
+        return true;
+    });
+    return new malRecord(m_layout, slots, extras);
 }
 
-malValuePtr malValue::meta() const
+uint32_t malRecordType::doHash() const
 {
-    return m_meta.ptr() == NULL ? mal::nilValue() : m_meta;
+    // Copies made by with-meta share the layout, and are equal.
+    return hashWord(reinterpret_cast<uintptr_t>(m_layout.ptr()));
 }
 
-malValuePtr malValue::withMeta(malValuePtr meta) const
+malValuePtr malMap::get(malValuePtr key) const
 {
-    return doWithMeta(meta);
+    const malValueRef* value = find(key);
+    return value == NULL ? mal::nilValue() : malValuePtr(*value);
 }
 
-malSequence::malSequence(malValueVec* items)
-: m_items(items)
+malValuePtr malMap::keys() const
 {
-
+    malValueVec* keys = new malValueVec();
+    keys->reserve(count());
+    forEach([keys](const malValuePtr& key, const malValuePtr& value) {
+        keys->push_back(key);
+        return true;
+    });
+    return mal::list(keys);
 }
 
-malSequence::malSequence(malValueIter begin, malValueIter end)
-: m_items(new malValueVec(begin, end))
+malValuePtr malMap::values() const
 {
-
+    malValueVec* values = new malValueVec();
+    values->reserve(count());
+    forEach([values](const malValuePtr& key, const malValuePtr& value) {
+        values->push_back(value);
+        return true;
+    });
+    return mal::list(values);
 }
 
-malSequence::malSequence(const malSequence& that, malValuePtr meta)
-: malValue(meta)
-, m_items(new malValueVec(*(that.m_items)))
+malValuePtr malMap::seq() const
 {
-
+    malValueVec* entries = new malValueVec();
+    entries->reserve(count());
+    forEach([entries](const malValuePtr& key, const malValuePtr& value) {
+        entries->push_back(mal::vector(key, value));
+        return true;
+    });
+    return mal::list(entries);
 }
 
-malSequence::~malSequence()
+String malMap::print(bool readably) const
 {
-    delete m_items;
+    String s = "{";
+    forEach([&s, readably](const malValuePtr& key, const malValuePtr& value) {
+        if (s.size() > 1) {
+            s += " ";
+        }
+        s += key->print(readably) + " " + value->print(readably);
+        return true;
+    });
+    return s + "}";
 }
 
-bool malSequence::doIsEqualTo(const malValue* rhs) const
+// Sorted maps and sets with equal entries hold them in the same order, so
+// are compared in step, which never compares keys of different types.
+static bool entriesEqual(const AVLTree& lhs, const AVLTree& rhs)
 {
-    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
-    if (count() != rhsSeq->count()) {
-        return false;
-    }
-
-    for (malValueIter it0 = m_items->begin(),
-                      it1 = rhsSeq->begin(),
-                      end = m_items->end(); it0 != end; ++it0, ++it1) {
-
-        if (! (*it0)->isEqualTo((*it1).ptr())) {
+    auto r_it = rhs.begin();
+    for (auto it = lhs.begin(), end = lhs.end(); it != end; ++it, ++r_it) {
+        if (!it->key()->isEqualTo(r_it->key().ptr()) ||
+            !it->value()->isEqualTo(r_it->value().ptr())) {
             return false;
         }
     }
     return true;
 }
 
-malValueVec* malSequence::evalItems(malEnvPtr env) const
+bool malMap::doIsEqualTo(const malValue* rhs) const
 {
-    malValueVec* items = new malValueVec;;
-    items->reserve(count());
-    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
-        items->push_back(EVAL(*it, env));
+    const malMap* r_map = static_cast<const malMap*>(rhs);
+
+    // A record is only equal to another of the same type.
+    const malRecord* record = dynamic_cast<const malRecord*>(this);
+    const malRecord* r_record = dynamic_cast<const malRecord*>(rhs);
+    if ((record || r_record) &&
+        !(record && r_record && record->layout() == r_record->layout())) {
+        return false;
     }
-    return items;
+
+    if (count() != r_map->count()) {
+        return false;
+    }
+
+    // Keys are looked up in a hash map where there is one, as a sorted map
+    // can't look up keys that don't compare with its own.
+    const malSortedMap* sorted = dynamic_cast<const malSortedMap*>(this);
+    const malSortedMap* r_sorted = dynamic_cast<const malSortedMap*>(rhs);
+    if (sorted && r_sorted) {
+        return entriesEqual(sorted->entries(), r_sorted->entries());
+    }
+    const malMap* visited = r_sorted ? r_map : this;
+    const malMap* searched = r_sorted ? this : r_map;
+    return visited->forEach([searched](const malValuePtr& key,
+                                       const malValuePtr& value) {
+        const malValueRef* found = searched->find(key);
+        return found != NULL && value->isEqualTo(found->ptr());
+    });
 }
 
-malValuePtr malSequence::first() const
+uint32_t malMap::doHash() const
 {
-    return count() == 0 ? mal::nilValue() : item(0);
+    // Hash maps visit their entries in no particular order, and must hash
+    // alike with equal sorted maps, so combine commutatively.
+    uint32_t hash = 0;
+    forEach([&hash](const malValuePtr& key, const malValuePtr& value) {
+        hash += combineHash(key->hash(), value->hash());
+        return true;
+    });
+    return mixHash(hash ^ count());
 }
 
-String malSequence::print(bool readably) const
+static HAMT addToSet(const HAMT& items,
+    malValueIter argsBegin, malValueIter argsEnd)
 {
-    String str;
-    auto end = m_items->cend();
-    auto it = m_items->cbegin();
-    if (it != end) {
-        str += (*it)->print(readably);
-        ++it;
-    }
-    for ( ; it != end; ++it) {
-        str += " ";
-        str += (*it)->print(readably);
+    HAMT result = items;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        result = result.assoc(*it, *it);
     }
-    return str;
+    return result;
 }
 
-malValuePtr malSequence::rest() const
+malHashSet::malHashSet(malValueIter argsBegin, malValueIter argsEnd,
+                       bool isEvaluated)
+: m_items(addToSet(HAMT(), argsBegin, argsEnd))
+, m_isEvaluated(isEvaluated)
 {
-    malValueIter start = (count() > 0) ? begin() + 1 : end();
-    return mal::list(start, end());
+
 }
 
-String malString::escapedValue() const
+malHashSet::malHashSet(const HAMT& items)
+: m_items(items)
+, m_isEvaluated(true)
 {
-    return escape(value());
+
 }
 
-String malString::print(bool readably) const
+malValuePtr
+malHashSet::conj(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return readably ? escapedValue() : value();
+    return mal::set(addToSet(m_items, argsBegin, argsEnd));
 }
 
-malValuePtr malSymbol::eval(malEnvPtr env)
+malValuePtr
+malHashSet::disj(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return env->get(value());
+    HAMT items = m_items;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.dissoc(*it);
+    }
+    return mal::set(items);
 }
 
-malValuePtr malVector::conj(malValueIter argsBegin,
-                            malValueIter argsEnd) const
+void malHashSet::conjInPlace(malValueIter argsBegin, malValueIter argsEnd)
 {
-    int oldItemCount = std::distance(begin(), end());
-    int newItemCount = std::distance(argsBegin, argsEnd);
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.assocInPlace(*it, *it);
+    }
+    m_isEvaluated = true;
+    reset();
+}
 
-    malValueVec* items = new malValueVec(oldItemCount + newItemCount);
-    std::copy(begin(), end(), items->begin());
-    std::copy(argsBegin, argsEnd, items->begin() + oldItemCount);
+void malHashSet::disjInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.dissocInPlace(*it);
+    }
+    m_isEvaluated = true;
+    reset();
+}
 
-    return mal::vector(items);
+malValuePtr malHashSet::eval(malEnvPtr env)
+{
+    if (m_isEvaluated) {
+        return malValuePtr(this);
+    }
+
+    HAMT items;
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        malValuePtr item = EVAL(it->key, env);
+        items = items.assoc(item, item);
+    }
+    return mal::set(items);
+}
+
+bool malHashSet::forEach(const Visitor& visit) const
+{
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        if (!visit(it->key)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+malValuePtr
+malSortedSet::conj(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    AVLTree items = m_items;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.assoc(*it, *it);
+    }
+    return mal::sortedSet(items);
+}
+
+malValuePtr
+malSortedSet::disj(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    AVLTree items = m_items;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.dissoc(*it);
+    }
+    return mal::sortedSet(items);
+}
+
+bool malSortedSet::forEach(const Visitor& visit) const
+{
+    for (auto it = m_items.begin(), end = m_items.end(); it != end; ++it) {
+        if (!visit(it->key())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+malValuePtr malSet::seq() const
+{
+    malValueVec* items = new malValueVec();
+    items->reserve(count());
+    forEach([items](const malValuePtr& item) {
+        items->push_back(item);
+        return true;
+    });
+    return mal::list(items);
+}
+
+String malSet::print(bool readably) const
+{
+    String s = "#{";
+    forEach([&s, readably](const malValuePtr& item) {
+        if (s.size() > 2) {
+            s += " ";
+        }
+        s += item->print(readably);
+        return true;
+    });
+    return s + "}";
+}
+
+bool malSet::doIsEqualTo(const malValue* rhs) const
+{
+    const malSet* r_set = static_cast<const malSet*>(rhs);
+    if (count() != r_set->count()) {
+        return false;
+    }
+
+    // As with maps, items are looked up in a hash set where there is one.
+    const malSortedSet* sorted = dynamic_cast<const malSortedSet*>(this);
+    const malSortedSet* r_sorted = dynamic_cast<const malSortedSet*>(rhs);
+    if (sorted && r_sorted) {
+        return entriesEqual(sorted->entries(), r_sorted->entries());
+    }
+    const malSet* visited = r_sorted ? r_set : this;
+    const malSet* searched = r_sorted ? this : r_set;
+    return visited->forEach([searched](const malValuePtr& item) {
+        return searched->contains(item);
+    });
+}
+
+uint32_t malSet::doHash() const
+{
+    uint32_t hash = 0;
+    forEach([&hash](const malValuePtr& item) {
+        hash += item->hash();
+        return true;
+    });
+    return mixHash(hash ^ count());
+}
+
+malValuePtr malTransient::assoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_FAIL("%s does not support assoc!", print(true).c_str());
+}
+
+malValuePtr malTransient::dissoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_FAIL("%s does not support dissoc!", print(true).c_str());
+}
+
+malValuePtr malTransient::disj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_FAIL("%s does not support disj!", print(true).c_str());
+}
+
+malValuePtr malTransient::doWithMeta(malValuePtr meta) const
+{
+    MAL_FAIL("%s does not support metadata", print(true).c_str());
+}
+
+malOwner malTransient::owner() const
+{
+    MAL_CHECK(m_owner != NO_OWNER, "Transient used after persistent! call");
+    return m_owner;
+}
+
+malValuePtr malTransient::persistent()
+{
+    owner(); // check it's still live
+    m_owner = NO_OWNER;
+    return makePersistent();
+}
+
+malValuePtr
+malTransientVector::conj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malOwner owner = this->owner();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.pushBackInPlace(*it, owner);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malTransientVector::makePersistent() const
+{
+    return mal::vector(m_items);
+}
+
+malValuePtr
+malTransientHash::conj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malOwner owner = this->owner();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSequence* entry = VALUE_CAST(malSequence, *it);
+        MAL_CHECK(entry->count() == 2, "conj! expects [key value] entries");
+        m_map.assocInPlace(entry->item(0), entry->item(1), owner);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr
+malTransientHash::assoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc! requires an even-sized list");
+
+    malOwner owner = this->owner();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        malValuePtr key = *it++;
+        m_map.assocInPlace(key, *it, owner);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr
+malTransientHash::dissoc(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malOwner owner = this->owner();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_map.dissocInPlace(*it, owner);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malTransientHash::makePersistent() const
+{
+    return mal::hash(m_map);
+}
+
+malValuePtr
+malTransientSet::conj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malOwner owner = this->owner();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.assocInPlace(*it, *it, owner);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr
+malTransientSet::disj(malValueIter argsBegin, malValueIter argsEnd)
+{
+    malOwner owner = this->owner();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        m_items.dissocInPlace(*it, owner);
+    }
+    return malValuePtr(this);
+}
+
+malValuePtr malTransientSet::makePersistent() const
+{
+    return mal::set(m_items);
+}
+
+uint32_t malInteger::doHash() const
+{
+    return hashWord(m_value);
+}
+
+uint32_t malBigInteger::doHash() const
+{
+    const std::vector<uint32_t>& limbs = m_value.limbs();
+    uint32_t hash = m_value.isNegative() ? 1 : 0;
+    for (auto it = limbs.begin(), end = limbs.end(); it != end; ++it) {
+        hash = combineHash(hash, *it);
+    }
+    return mixHash(hash);
+}
+
+String malDouble::print(bool readably) const
+{
+    if (std::isnan(m_value)) {
+        return "NaN";
+    }
+    if (std::isinf(m_value)) {
+        return m_value > 0 ? "Infinity" : "-Infinity";
+    }
+
+    // Find the fewest significant digits which read back as the same value.
+    // Seventeen are always enough.
+    char buffer[32];
+    int digits = 1;
+    for ( ; ; digits++) {
+        snprintf(buffer, sizeof buffer, "%.*e", digits - 1, m_value);
+        if (digits == 17 || strtod(buffer, NULL) == m_value) {
+            break;
+        }
+    }
+
+    // Write those digits without an exponent unless the value is very large
+    // or small, always with a decimal point so that it reads as a double.
+    int exponent = m_value == 0 ? 0 : atoi(strchr(buffer, 'e') + 1);
+    if (exponent < -4 || exponent >= 16) {
+        String str = buffer;
+        if (digits == 1) {
+            str.insert(str.find('e'), ".0");
+        }
+        return str;
+    }
+    int decimals = std::max(1, digits - 1 - exponent);
+    snprintf(buffer, sizeof buffer, "%.*f", decimals, m_value);
+    return buffer;
+}
+
+uint32_t malDouble::doHash() const
+{
+    // 0.0 and -0.0 are equal, so they must hash alike.
+    double value = m_value == 0 ? 0 : m_value;
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    return hashWord(bits);
+}
+
+malIntVector::malIntVector(malIntVec* items)
+: m_items(*items)
+{
+    makeAcyclic();
+    delete items;
+}
+
+malValuePtr malIntVector::seq() const
+{
+    malValueVec* items = new malValueVec;
+    items->reserve(count());
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        items->push_back(mal::integer(*it));
+    }
+    return mal::list(items);
+}
+
+malValuePtr malIntVector::sum() const
+{
+    // The low and high halves of the items are totalled separately, which
+    // can't overflow with fewer than 2^31 items, and so stays a plain loop
+    // for the compiler to vectorise. Only their sum may need a bignum.
+    const int64_t* items = m_items->data();
+    uint64_t low = 0;
+    int64_t high = 0;
+    for (int i = 0, n = count(); i < n; i++) {
+        low += static_cast<uint32_t>(items[i]);
+        high += items[i] >> 32;
+    }
+    int64_t total;
+    if (!multiplyOverflows(high, INT64_C(1) << 32, total) &&
+        !addOverflows(total, static_cast<int64_t>(low), total)) {
+        return mal::integer(total);
+    }
+    return mal::integer(BigInteger(high) * (INT64_C(1) << 32) +
+                        static_cast<int64_t>(low));
+}
+
+int64_t malIntVector::min() const
+{
+    MAL_CHECK(!isEmpty(), "min of an empty int-vector");
+    const int64_t* items = m_items->data();
+    int64_t least = items[0];
+    for (int i = 1, n = count(); i < n; i++) {
+        least = items[i] < least ? items[i] : least;
+    }
+    return least;
+}
+
+int64_t malIntVector::max() const
+{
+    MAL_CHECK(!isEmpty(), "max of an empty int-vector");
+    const int64_t* items = m_items->data();
+    int64_t greatest = items[0];
+    for (int i = 1, n = count(); i < n; i++) {
+        greatest = items[i] > greatest ? items[i] : greatest;
+    }
+    return greatest;
+}
+
+malValuePtr malIntVector::dot(const malIntVector& that) const
+{
+    MAL_CHECK(count() == that.count(),
+              "dot of int-vectors of lengths %d and %d",
+              count(), that.count());
+    // As with sum, the total moves to a bignum once it overflows.
+    const int64_t* lhs = m_items->data();
+    const int64_t* rhs = that.m_items->data();
+    int64_t total = 0;
+    int i = 0, n = count();
+    for (int64_t product; i < n; i++) {
+        if (multiplyOverflows(lhs[i], rhs[i], product) ||
+            addOverflows(total, product, product)) {
+            break;
+        }
+        total = product;
+    }
+    if (i == n) {
+        return mal::integer(total);
+    }
+    BigInteger bigTotal = total;
+    for ( ; i < n; i++) {
+        bigTotal = bigTotal + BigInteger(lhs[i]) * rhs[i];
+    }
+    return mal::integer(bigTotal);
+}
+
+String malIntVector::print(bool readably) const
+{
+    String str;
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        if (it != m_items->begin()) {
+            str += " ";
+        }
+        str += std::to_string(*it);
+    }
+    return '[' + str + ']';
+}
+
+bool malIntVector::doIsEqualTo(const malValue* rhs) const
+{
+    if (const malIntVector* rhsInts = dynamic_cast<const malIntVector*>(rhs)) {
+        return items() == rhsInts->items();
+    }
+
+    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
+    if (count() != rhsSeq->count()) {
+        return false;
+    }
+    auto it1 = rhsSeq->begin();
+    for (auto it0 = m_items->begin(), end = m_items->end();
+         it0 != end; ++it0, ++it1) {
+        const malInteger* item = dynamic_cast<const malInteger*>((*it1).ptr());
+        if (!item || item->value() != *it0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t malIntVector::doHash() const
+{
+    // As malSequence::doHash, over the hashes the items would have boxed.
+    uint32_t hash = count();
+    for (auto it = m_items->begin(), end = m_items->end(); it != end; ++it) {
+        hash = combineHash(hash, cachedHash(hashWord(*it)));
+    }
+    return mixHash(hash);
+}
+
+malLambda::malLambda(StringVec& bindings,
+                     malValuePtr body, malEnvPtr env)
+: m_scope(new malScope(bindings, env->scope(), true))
+, m_body(body)
+, m_env(env)
+, m_isMacro(false)
+{
+
+}
+
+malLambda::malLambda(malScopePtr scope, malValuePtr body, malEnvPtr env)
+: m_scope(scope)
+, m_body(body)
+, m_env(env)
+, m_isMacro(false)
+{
+
+}
+
+malLambda::malLambda(const malLambda& that, malValuePtr meta)
+: Counted(meta)
+, m_scope(that.m_scope)
+, m_body(that.m_body)
+, m_env(that.m_env)
+, m_isMacro(that.m_isMacro)
+{
+
+}
+
+malLambda::malLambda(const malLambda& that, bool isMacro)
+: Counted(that.metaOrNull())
+, m_scope(that.m_scope)
+, m_body(that.m_body)
+, m_env(that.m_env)
+, m_isMacro(isMacro)
+{
+
+}
+
+malValuePtr malLambda::apply(malValueIter argsBegin,
+                             malValueIter argsEnd) const
+{
+    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+}
+
+malValuePtr malLambda::doWithMeta(malValuePtr meta) const
+{
+    return new malLambda(*this, meta);
+}
+
+void malLambda::getChildren(RefCountedVec& children) const
+{
+    malValue::getChildren(children);
+    children.push_back(m_scope.ptr());
+    children.push_back(m_body.ptr());
+    children.push_back(m_env.ptr());
+}
+
+malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
+{
+    return malEnvPtr(new malEnv(m_env, m_scope, argsBegin, argsEnd));
+}
+
+malValuePtr malList::conj(malValueIter argsBegin,
+                          malValueIter argsEnd) const
+{
+    RRBVector items = this->items();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.pushFront(*it);
+    }
+
+    return mal::list(items);
+}
+
+void malList::conjInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    RRBVector items = takeItems();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items.pushFrontInPlace(*it);
+    }
+    reuse(items);
+}
+
+malValuePtr malList::eval(malEnvPtr env)
+{
+    // Note, this isn't actually called since the TCO updates, but
+    // is required for the earlier steps, so don't get rid of it.
+    if (count() == 0) {
+        return malValuePtr(this);
+    }
+
+    std::unique_ptr<malValueVec> items(evalItems(env));
+    auto it = items->begin();
+    malValuePtr op = *it;
+    return APPLY(op, ++it, items->end());
+}
+
+String malList::print(bool readably) const
+{
+    return '(' + malSequence::print(readably) + ')';
+}
+
+malValuePtr malValue::eval(malEnvPtr env)
+{
+    // Default case of eval is just to return the object itself.
+    return malValuePtr(this);
+}
+
+static bool isSequential(const malValue* value)
+{
+    return dynamic_cast<const malSequence*>(value) ||
+           dynamic_cast<const malIntVector*>(value);
+}
+
+bool malValue::isEqualTo(const malValue* rhs) const
+{
+    // Special-case. Vectors, int-vectors and lists can be compared, as can
+    // hashed and sorted maps, and hashed and sorted sets.
+    bool matchingTypes = (typeid(*this) == typeid(*rhs)) ||
+        (isSequential(this) && isSequential(rhs)) ||
+        (dynamic_cast<const malMap*>(this) &&
+         dynamic_cast<const malMap*>(rhs)) ||
+        (dynamic_cast<const malSet*>(this) &&
+         dynamic_cast<const malSet*>(rhs));
+
+    if (!matchingTypes) {
+        return false;
+    }
+
+    // Cached hashes can rule out a deep comparison.
+    if (m_hash != 0 && rhs->m_hash != 0 && m_hash != rhs->m_hash) {
+        return false;
+    }
+    return doIsEqualTo(rhs);
+}
+
+// The position of each sortable type in the order used by compareValues.
+enum TypeRank {
+    RANK_NIL, RANK_BOOLEAN, RANK_NUMBER, RANK_STRING, RANK_KEYWORD,
+    RANK_SYMBOL, RANK_SEQUENCE, RANK_OTHER
+};
+
+static double numberValue(const malValuePtr& value)
+{
+    if (const malInteger* number = DYNAMIC_CAST(malInteger, value)) {
+        return number->value();
+    }
+    if (const malBigInteger* number = DYNAMIC_CAST(malBigInteger, value)) {
+        return number->value().toDouble();
+    }
+    return STATIC_CAST(malDouble, value)->value();
+}
+
+static BigInteger integerValue(const malValuePtr& value)
+{
+    if (const malInteger* number = DYNAMIC_CAST(malInteger, value)) {
+        return number->value();
+    }
+    return STATIC_CAST(malBigInteger, value)->value();
+}
+
+static TypeRank typeRank(const malValuePtr& value)
+{
+    const malValue* ptr = value.ptr();
+    if (dynamic_cast<const malInteger*>(ptr))    { return RANK_NUMBER; }
+    if (dynamic_cast<const malBigInteger*>(ptr)) { return RANK_NUMBER; }
+    if (dynamic_cast<const malDouble*>(ptr))     { return RANK_NUMBER; }
+    if (dynamic_cast<const malKeyword*>(ptr))    { return RANK_KEYWORD; }
+    if (dynamic_cast<const malString*>(ptr))     { return RANK_STRING; }
+    if (dynamic_cast<const malSymbol*>(ptr))     { return RANK_SYMBOL; }
+    if (dynamic_cast<const malSequence*>(ptr))   { return RANK_SEQUENCE; }
+    if (value == mal::nilValue())                { return RANK_NIL; }
+    if (value == mal::falseValue() || value == mal::trueValue()) {
+        return RANK_BOOLEAN;
+    }
+    return RANK_OTHER;
+}
+
+template <typename T>
+static int compareOrdered(const T& lhs, const T& rhs)
+{
+    return (lhs < rhs) ? -1 : (rhs < lhs) ? 1 : 0;
+}
+
+int compareValues(const malValuePtr& lhs, const malValuePtr& rhs)
+{
+    if (lhs == rhs) {
+        return 0;
+    }
+
+    TypeRank rank = typeRank(lhs);
+    TypeRank rhsRank = typeRank(rhs);
+    if (rank != rhsRank) {
+        return compareOrdered(rank, rhsRank);
+    }
+
+    switch (rank) {
+        case RANK_BOOLEAN:
+            // These are singletons, so they must be false and true.
+            return lhs == mal::falseValue() ? -1 : 1;
+
+        case RANK_NUMBER: {
+            const malInteger* lhsInt = DYNAMIC_CAST(malInteger, lhs);
+            const malInteger* rhsInt = DYNAMIC_CAST(malInteger, rhs);
+            if (lhsInt && rhsInt) {
+                return compareOrdered(lhsInt->value(), rhsInt->value());
+            }
+            if (DYNAMIC_CAST(malDouble, lhs) || DYNAMIC_CAST(malDouble, rhs)) {
+                // NaN is unordered, so give it a place, as Java does: after
+                // every other number, and equal to itself.
+                double lhsValue = numberValue(lhs);
+                double rhsValue = numberValue(rhs);
+                bool lhsIsNaN = std::isnan(lhsValue);
+                bool rhsIsNaN = std::isnan(rhsValue);
+                if (lhsIsNaN || rhsIsNaN) {
+                    return compareOrdered(lhsIsNaN, rhsIsNaN);
+                }
+                return compareOrdered(lhsValue, rhsValue);
+            }
+            return integerValue(lhs).compare(integerValue(rhs));
+        }
+
+        case RANK_STRING:
+        case RANK_KEYWORD:
+        case RANK_SYMBOL:
+            return compareOrdered(STATIC_CAST(malStringBase, lhs)->value(),
+                                  STATIC_CAST(malStringBase, rhs)->value());
+
+        case RANK_SEQUENCE: {
+            const malSequence* lhsSeq = STATIC_CAST(malSequence, lhs);
+            const malSequence* rhsSeq = STATIC_CAST(malSequence, rhs);
+            auto it0 = lhsSeq->begin(), end0 = lhsSeq->end();
+            auto it1 = rhsSeq->begin(), end1 = rhsSeq->end();
+            for ( ; it0 != end0 && it1 != end1; ++it0, ++it1) {
+                if (int order = compareValues(*it0, *it1)) {
+                    return order;
+                }
+            }
+            return compareOrdered(lhsSeq->count(), rhsSeq->count());
+        }
+
+        default:
+            MAL_CHECK(lhs->isEqualTo(rhs.ptr()), "%s and %s cannot be compared",
+                      lhs->print(true).c_str(), rhs->print(true).c_str());
+            return 0;
+    }
+}
+
+uint32_t malValue::doHash() const
+{
+    // Default case is identity, for values only equal to themselves.
+    return hashWord(reinterpret_cast<uintptr_t>(this));
+}
+
+bool malValue::isTrue() const
+{
+    return (this != malFalse) && (this != malNil);
+}
+
+//  The metadata of each value flagged m_hasMeta. It's never destroyed, so
+//  values may outlive static destruction.
+typedef std::unordered_map<const malValue*, malValuePtr> MetaTable;
+static MetaTable* metaTable = NULL;
+
+malValue::malValue(malValuePtr meta)
+: m_hash(0)
+, m_hasMeta(meta.ptr() != NULL)
+{
+    TRACE_OBJECT("Creating malValue %p\n", this);
+    if (m_hasMeta) {
+        if (metaTable == NULL) {
+            metaTable = new MetaTable;
+        }
+        (*metaTable)[this] = meta;
+    }
+}
+
+void malValue::clearMeta()
+{
+    // Releasing the metadata may destroy other values with metadata, so
+    // it's taken out of the table before it's released.
+    auto it = metaTable->find(this);
+    malValuePtr meta = it->second;
+    metaTable->erase(it);
+    m_hasMeta = false;
+}
+
+malValuePtr malValue::metaOrNull() const
+{
+    return m_hasMeta ? metaTable->find(this)->second : malValuePtr();
+}
+
+void malValue::getChildren(RefCountedVec& children) const
+{
+    // Not through metaOrNull, as that would acquire and release the
+    // metadata while the collector is trial-deleting references.
+    if (m_hasMeta) {
+        children.push_back(metaTable->find(this)->second.ptr());
+    }
+}
+
+malValuePtr malValue::meta() const
+{
+    return m_hasMeta ? metaTable->find(this)->second : mal::nilValue();
+}
+
+malValuePtr malValue::withMeta(malValuePtr meta) const
+{
+    return doWithMeta(meta);
+}
+
+malSequence::malSequence(malValueVec* items)
+: m_items(items)
+{
+
+}
+
+malSequence::malSequence(malValueIter begin, malValueIter end)
+: m_items(begin, end)
+{
+
+}
+
+malSequence::malSequence(const RRBVector& items)
+: m_items(items)
+{
+
+}
+
+malSequence::malSequence(const malSequence& that, malValuePtr meta)
+: malValue(meta)
+, m_items(that.m_items)
+{
+
+}
+
+bool malSequence::doIsEqualTo(const malValue* rhs) const
+{
+    if (const malIntVector* rhsInts = dynamic_cast<const malIntVector*>(rhs)) {
+        return rhsInts->doIsEqualTo(this);
+    }
+    const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
+    if (count() != rhsSeq->count()) {
+        return false;
+    }
+
+    for (Iterator it0 = begin(), it1 = rhsSeq->begin(), end = this->end();
+         it0 != end; ++it0, ++it1) {
+
+        if (! (*it0)->isEqualTo((*it1).ptr())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t malSequence::doHash() const
+{
+    // Lists and vectors compare equal, so the type mustn't affect this.
+    uint32_t hash = count();
+    for (Iterator it = begin(), end = this->end(); it != end; ++it) {
+        hash = combineHash(hash, (*it)->hash());
+    }
+    return mixHash(hash);
+}
+
+malValueVec* malSequence::evalItems(malEnvPtr env) const
+{
+    malValueVec* items = new malValueVec;;
+    items->reserve(count());
+    for (Iterator it = begin(), end = this->end(); it != end; ++it) {
+        items->push_back(EVAL(*it, env));
+    }
+    return items;
+}
+
+malValuePtr malSequence::first() const
+{
+    return count() == 0 ? mal::nilValue() : item(0);
+}
+
+String malSequence::print(bool readably) const
+{
+    String str;
+    Iterator end = this->end();
+    Iterator it = begin();
+    if (it != end) {
+        str += (*it)->print(readably);
+        ++it;
+    }
+    for ( ; it != end; ++it) {
+        str += " ";
+        str += (*it)->print(readably);
+    }
+    return str;
+}
+
+malValuePtr malSequence::rest() const
+{
+    return mal::list(m_items.drop(1));
+}
+
+RRBVector malSequence::takeItems()
+{
+    // Hand over the only reference to the tree, so that it stays unshared.
+    RRBVector items = m_items;
+    m_items = RRBVector();
+    reset();
+    return items;
+}
+
+void malSequence::reuse(const RRBVector& items)
+{
+    m_items = items;
+    reset();
+}
+
+uint32_t malStringBase::doHash() const
+{
+    return hashWord(std::hash<String>()(m_value));
+}
+
+String malString::escapedValue() const
+{
+    return escape(value());
+}
+
+String malString::print(bool readably) const
+{
+    return readably ? escapedValue() : value();
+}
+
+malSymbol::malSymbol(const String& token)
+: Counted(token)
+, m_epoch(0)
+, m_depth(0)
+, m_slot(0)
+, m_cell(NULL)
+{
+
+}
+
+malSymbol::malSymbol(const malSymbol& that, malValuePtr meta)
+: Counted(that, meta)
+, m_epoch(0)
+, m_depth(0)
+, m_slot(0)
+, m_cell(NULL)
+{
+
+}
+
+malValuePtr malSymbol::eval(malEnvPtr env)
+{
+    if (malValuePtr found = lookup(env)) {
+        return found;
+    }
+    MAL_FAIL("'%s' not found", value().c_str());
+}
+
+malValuePtr malSymbol::lookup(malEnvPtr env) const
+{
+    malScope* scope = env->scope();
+    if (scope == NULL || m_scope.ptr() != scope
+                      || m_epoch != malScope::epoch()) {
+        if (!resolve(env.ptr())) {
+            return env->lookup(value());
+        }
+    }
+    if (m_cell != NULL) {
+        return *m_cell;
+    }
+
+    malEnv* frame = env.ptr();
+    for (int i = m_depth; i > 0; i--) {
+        frame = frame->outer();
+    }
+    if (m_slot < 0) {
+        // A global which wasn't defined when this was resolved; if it has
+        // been since, it has a cell now.
+        m_cell = frame->cell(value());
+        return m_cell != NULL ? *m_cell : malValuePtr();
+    }
+    if (const malValuePtr& found = frame->slot(m_slot)) {
+        return found;
+    }
+    // It's being bound by a let* whose binding for it is still to come,
+    // so any binding outside that shows through.
+    return env->lookup(value());
+}
+
+bool malSymbol::resolve(malEnv* env) const
+{
+    malScope* start = env->scope();
+    m_scope = NULL;
+    int depth = 0;
+    for (malScope* scope = start; scope; scope = scope->outer(), depth++) {
+        int slot = scope->slotOf(value());
+        if (slot >= 0 || scope->isRoot()) {
+            m_scope = start;
+            m_epoch = malScope::epoch();
+            m_depth = depth;
+            m_slot = slot;
+            m_cell = slot >= 0 ? NULL : env->cell(value());
+            return true;
+        }
+        if (scope->isDynamic()) {
+            break;
+        }
+        env = env->outer();
+    }
+    return false;
+}
+
+malScopePtr malSymbol::formScope() const
+{
+    return m_formScope;
+}
+
+void malSymbol::setFormScope(malScopePtr scope) const
+{
+    m_formScope = scope;
+}
+
+void malSymbol::getChildren(RefCountedVec& children) const
+{
+    malValue::getChildren(children);
+    children.push_back(m_scope.ptr());
+    children.push_back(m_formScope.ptr());
+}
+
+malValuePtr malVector::conj(malValueIter argsBegin,
+                            malValueIter argsEnd) const
+{
+    RRBVector items = this->items();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items = items.pushBack(*it);
+    }
+
+    return mal::vector(items);
+}
+
+void malVector::conjInPlace(malValueIter argsBegin, malValueIter argsEnd)
+{
+    RRBVector items = takeItems();
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        items.pushBackInPlace(*it);
+    }
+    reuse(items);
 }
 
 malValuePtr malVector::eval(malEnvPtr env)
@@ -1,23 +1,29 @@
 #ifndef INCLUDE_TYPES_H
 #define INCLUDE_TYPES_H
 
+#include "AVLTree.h"
+#include "BigInteger.h"
+#include "HAMT.h"
 #include "MAL.h"
+#include "RRBVector.h"
+#include "SharedVector.h"
 
 #include <exception>
-#include <map>
+#include <functional>
 
 class malEmptyInputException : public std::exception { };
 
 class malValue : public RefCounted {
 public:
-    malValue() {
-        TRACE_OBJECT("Creating malValue %p\n", this);
-    }
-    malValue(malValuePtr meta) : m_meta(meta) {
+    malValue() : m_hash(0), m_hasMeta(false) {
         TRACE_OBJECT("Creating malValue %p\n", this);
     }
+    malValue(malValuePtr meta);
     virtual ~malValue() {
         TRACE_OBJECT("Destroying malValue %p\n", this);
+        if (m_hasMeta) {
+            clearMeta();
+        }
     }
 
     malValuePtr withMeta(malValuePtr meta) const;
@@ -28,14 +34,53 @@ public:
 
     bool isEqualTo(const malValue* rhs) const;
 
+    // Values which are isEqualTo each other must hash alike. Values are
+    // immutable (atoms hash by identity), so the hash is cached on first use.
+    uint32_t hash() const {
+        if (m_hash == 0) {
+            m_hash = cachedHash(doHash());
+        }
+        return m_hash;
+    }
+
+    // The hash which is cached for (and returned by hash for) a value whose
+    // doHash returns hash. It has 31 bits, to leave room for m_hasMeta, and
+    // is never 0, which means not yet computed.
+    static uint32_t cachedHash(uint32_t hash) {
+        hash &= 0x7fffffff;
+        return hash != 0 ? hash : 1;
+    }
+
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual String print(bool readably) const = 0;
 
+    // Subclasses which hold references add theirs to the metadata's.
+    virtual void getChildren(RefCountedVec& children) const;
+
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
+    virtual uint32_t doHash() const;
 
-    malValuePtr m_meta;
+    // Returns NULL if the value has no metadata.
+    malValuePtr metaOrNull() const;
+
+    // For a value being updated in place, to hold a new value.
+    void reset() {
+        m_hash = 0;
+        if (m_hasMeta) {
+            clearMeta();
+        }
+    }
+
+private:
+    void clearMeta();
+
+    // Hardly any values have metadata, so rather than each holding a pointer
+    // to it, those that do are flagged, and it's kept in a table on the
+    // side. The flag and hash share the padding after RefCounted.
+    mutable uint32_t m_hash : 31;
+    uint32_t m_hasMeta : 1;
 };
 
 template<class T>
@@ -55,11 +100,11 @@ T* value_cast(malValuePtr obj, const char* typeName) {
         return new Type(*this, meta); \
     } \
 
-class malConstant : public malValue {
+class malConstant : public Counted<malConstant, malValue> {
 public:
-    malConstant(String name) : m_name(name) { }
+    malConstant(String name) : m_name(name) { makeAcyclic(); }
     malConstant(const malConstant& that, malValuePtr meta)
-        : malValue(meta), m_name(that.m_name) { }
+        : Counted(meta), m_name(that.m_name) { }
 
     virtual String print(bool readably) const { return m_name; }
 
@@ -73,11 +118,11 @@ private:
     const String m_name;
 };
 
-class malInteger : public malValue {
+class malInteger : public Counted<malInteger, malValue> {
 public:
-    malInteger(int64_t value) : m_value(value) { }
+    malInteger(int64_t value) : m_value(value) { makeAcyclic(); }
     malInteger(const malInteger& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : Counted(meta), m_value(that.m_value) { }
 
     virtual String print(bool readably) const {
         return std::to_string(m_value);
@@ -89,33 +134,88 @@ public:
         return m_value == static_cast<const malInteger*>(rhs)->m_value;
     }
 
+    virtual uint32_t doHash() const;
+
     WITH_META(malInteger);
 
 private:
     const int64_t m_value;
 };
 
+//  An integer outside the range of int64_t. Arithmetic returns a malInteger
+//  whenever the result fits in one, so the two never hold the same value.
+class malBigInteger : public Counted<malBigInteger, malValue> {
+public:
+    malBigInteger(const BigInteger& value) : m_value(value) {
+        makeAcyclic();
+    }
+    malBigInteger(const malBigInteger& that, malValuePtr meta)
+        : Counted(meta), m_value(that.m_value) { }
+
+    virtual String print(bool readably) const {
+        return m_value.toString();
+    }
+
+    const BigInteger& value() const { return m_value; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_value.compare(
+            static_cast<const malBigInteger*>(rhs)->m_value) == 0;
+    }
+
+    virtual uint32_t doHash() const;
+
+    WITH_META(malBigInteger);
+
+private:
+    const BigInteger m_value;
+};
+
+class malDouble : public Counted<malDouble, malValue> {
+public:
+    malDouble(double value) : m_value(value) { makeAcyclic(); }
+    malDouble(const malDouble& that, malValuePtr meta)
+        : Counted(meta), m_value(that.m_value) { }
+
+    virtual String print(bool readably) const;
+
+    double value() const { return m_value; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_value == static_cast<const malDouble*>(rhs)->m_value;
+    }
+
+    virtual uint32_t doHash() const;
+
+    WITH_META(malDouble);
+
+private:
+    const double m_value;
+};
+
 class malStringBase : public malValue {
 public:
     malStringBase(const String& token)
-        : m_value(token) { }
+        : m_value(token) { makeAcyclic(); }
     malStringBase(const malStringBase& that, malValuePtr meta)
         : malValue(meta), m_value(that.value()) { }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
+
+    virtual uint32_t doHash() const;
 
 private:
     const String m_value;
 };
 
-class malString : public malStringBase {
+class malString : public Counted<malString, malStringBase> {
 public:
     malString(const String& token)
-        : malStringBase(token) { }
+        : Counted(token) { }
     malString(const malString& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : Counted(that, meta) { }
 
     virtual String print(bool readably) const;
 
@@ -128,12 +228,12 @@ public:
     WITH_META(malString);
 };
 
-class malKeyword : public malStringBase {
+class malKeyword : public Counted<malKeyword, malStringBase> {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : Counted(token) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : Counted(that, meta) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malKeyword*>(rhs)->value();
@@ -142,40 +242,64 @@ public:
     WITH_META(malKeyword);
 };
 
-class malSymbol : public malStringBase {
+class malSymbol : public Counted<malSymbol, malStringBase> {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
-    malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+    malSymbol(const String& token);
+    malSymbol(const malSymbol& that, malValuePtr meta);
 
     virtual malValuePtr eval(malEnvPtr env);
 
+    // Returns NULL if the symbol isn't bound.
+    malValuePtr lookup(malEnvPtr env) const;
+
+    // The scope last made for the fn*, let* or catch* form this heads.
+    malScopePtr formScope() const;
+    void setFormScope(malScopePtr scope) const;
+
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
     }
 
+    virtual void getChildren(RefCountedVec& children) const;
+
     WITH_META(malSymbol);
+
+private:
+    bool resolve(malEnv* env) const;
+
+    // Where the symbol was found from a frame of m_scope: m_depth frames
+    // out, in slot m_slot, or if that's negative, in the global frame's
+    // cell m_cell, once it has one. It's there until the epoch changes.
+    mutable malScopePtr  m_scope;
+    mutable malScopePtr  m_formScope;
+    mutable unsigned     m_epoch;
+    mutable int          m_depth;
+    mutable int          m_slot;
+    mutable malValuePtr* m_cell;
 };
 
 class malSequence : public malValue {
 public:
+    typedef RRBVector::Iterator Iterator;
+
     malSequence(malValueVec* items);
     malSequence(malValueIter begin, malValueIter end);
+    malSequence(const RRBVector& items);
     malSequence(const malSequence& that, malValuePtr meta);
-    virtual ~malSequence();
 
     virtual String print(bool readably) const;
 
     malValueVec* evalItems(malEnvPtr env) const;
-    int count() const { return m_items->size(); }
-    bool isEmpty() const { return m_items->empty(); }
-    malValuePtr item(int index) const { return (*m_items)[index]; }
+    int count() const { return m_items.count(); }
+    bool isEmpty() const { return m_items.isEmpty(); }
+    malValuePtr item(int index) const { return m_items.item(index); }
+    const RRBVector& items() const { return m_items; }
 
-    malValueIter begin() const { return m_items->begin(); }
-    malValueIter end()   const { return m_items->end(); }
+    Iterator begin() const { return m_items.begin(); }
+    Iterator end()   const { return m_items.end(); }
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual uint32_t doHash() const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                               malValueIter argsEnd) const = 0;
@@ -183,44 +307,102 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    // These are only for a sequence which nothing else refers to, as they
+    // update it in place, reusing as much of its storage as they can.
+    virtual void conjInPlace(malValueIter argsBegin,
+                             malValueIter argsEnd) = 0;
+    RRBVector takeItems(); // leaves the sequence empty
+    void reuse(const RRBVector& items);
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_items.getChildren(children);
+    }
+
 private:
-    malValueVec* const m_items;
+    RRBVector m_items;
 };
 
-class malList : public malSequence {
+class malList : public Counted<malList, malSequence> {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items) : Counted(items) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : Counted(begin, end) { }
+    malList(const RRBVector& items) : Counted(items) { }
     malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : Counted(that, meta) { }
 
     virtual String print(bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    virtual void conjInPlace(malValueIter argsBegin, malValueIter argsEnd);
 
     WITH_META(malList);
 };
 
-class malVector : public malSequence {
+class malVector : public Counted<malVector, malSequence> {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
+    malVector(malValueVec* items) : Counted(items) { }
     malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : Counted(begin, end) { }
+    malVector(const RRBVector& items) : Counted(items) { }
     malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : Counted(that, meta) { }
 
     virtual malValuePtr eval(malEnvPtr env);
     virtual String print(bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
+    virtual void conjInPlace(malValueIter argsBegin, malValueIter argsEnd);
 
     WITH_META(malVector);
 };
 
+//  A vector of 64-bit integers held unboxed in one contiguous array, so that
+//  numeric scans over it stream through memory rather than chasing a pointer
+//  to each item. It prints, compares and hashes as a vector of integers.
+class malIntVector : public Counted<malIntVector, malValue> {
+public:
+    malIntVector(malIntVec* items);
+    malIntVector(const malIntVector& that, malValuePtr meta)
+        : Counted(meta), m_items(that.m_items) { }
+
+    int count() const { return m_items->size(); }
+    bool isEmpty() const { return m_items->empty(); }
+    int64_t item(int index) const { return (*m_items)[index]; }
+    const malIntVec& items() const { return *m_items; }
+
+    // The items as a list of integers.
+    malValuePtr seq() const;
+
+    // These are written as plain loops over the array for the compiler to
+    // vectorise, except dot, which checks each product for overflow. sum
+    // and dot are exact, giving a bignum if need be. min and max fail if
+    // the vector is empty, and dot if the vectors' lengths differ.
+    malValuePtr sum() const;
+    int64_t min() const;
+    int64_t max() const;
+    malValuePtr dot(const malIntVector& that) const;
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual uint32_t doHash() const;
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_items.getChildren(children);
+    }
+
+    WITH_META(malIntVector);
+
+private:
+    const SharedVector<int64_t> m_items;
+};
+
 class malApplicable : public malValue {
 public:
     malApplicable() { }
@@ -230,45 +412,323 @@ public:
                                malValueIter argsEnd) const = 0;
 };
 
-class malHash : public malValue {
+class malMap : public malValue {
 public:
-    typedef std::map<String, malValuePtr> Map;
+    typedef std::function<bool (const malValuePtr& key,
+                                const malValuePtr& value)> Visitor;
 
-    malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
-    malHash(const malHash::Map& map);
-    malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    malMap() { }
+    malMap(malValuePtr meta) : malValue(meta) { }
 
-    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    bool contains(malValuePtr key) const;
-    malValuePtr eval(malEnvPtr env);
+    virtual int count() const = 0;
+    bool isEmpty() const { return count() == 0; }
+
+    // Returns NULL if the key isn't present.
+    virtual const malValueRef* find(malValuePtr key) const = 0;
+
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const = 0;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const = 0;
+
+    // Calls visit on each entry in turn, until it returns false.
+    virtual bool forEach(const Visitor& visit) const = 0;
+
+    bool contains(malValuePtr key) const { return find(key) != NULL; }
     malValuePtr get(malValuePtr key) const;
     malValuePtr keys() const;
     malValuePtr values() const;
+    malValuePtr seq() const;
 
     virtual String print(bool readably) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual uint32_t doHash() const;
+};
+
+class malHash : public Counted<malHash, malMap> {
+public:
+    malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
+    malHash(const HAMT& map);
+    malHash(const malHash& that, malValuePtr meta)
+    : Counted(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+
+    virtual int count() const { return m_map.count(); }
+    virtual const malValueRef* find(malValuePtr key) const {
+        return m_map.find(key);
+    }
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool forEach(const Visitor& visit) const;
+
+    malValuePtr eval(malEnvPtr env);
+
+    const HAMT& entries() const { return m_map; }
+
+    // Only for a map which nothing else refers to.
+    void assocInPlace(malValueIter argsBegin, malValueIter argsEnd);
+    void dissocInPlace(malValueIter argsBegin, malValueIter argsEnd);
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_map.getChildren(children);
+    }
 
     WITH_META(malHash);
 
 private:
-    const Map m_map;
-    const bool m_isEvaluated;
+    HAMT m_map;
+    bool m_isEvaluated;
+};
+
+class malSortedMap : public Counted<malSortedMap, malMap> {
+public:
+    malSortedMap(const AVLTree& map) : m_map(map) { }
+    malSortedMap(const malSortedMap& that, malValuePtr meta)
+    : Counted(meta), m_map(that.m_map) { }
+
+    virtual int count() const { return m_map.count(); }
+    virtual const malValueRef* find(malValuePtr key) const {
+        return m_map.find(key);
+    }
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool forEach(const Visitor& visit) const;
+
+    const AVLTree& entries() const { return m_map; }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_map.getChildren(children);
+    }
+
+    WITH_META(malSortedMap);
+
+private:
+    const AVLTree m_map;
+};
+
+//  The layout shared by every record of a type: its name, and its fields'
+//  keywords in order, with a map from each keyword to its slot.
+
+class RecordLayout : public Counted<RecordLayout, RefCounted> {
+public:
+    RecordLayout(const String& name, malValueVec& fields);
+
+    const String& name() const { return m_name; }
+    int fieldCount() const { return m_fields.size(); }
+    const malValuePtr& field(int slot) const { return m_fields[slot]; }
+
+    // Returns -1 if the key isn't one of the fields.
+    int slot(malValuePtr key) const;
+
+    virtual void getChildren(RefCountedVec& children) const;
+
+#ifdef MAL_TRACING_GC
+    virtual const void* ownedBuffer() const { return m_fields.data(); }
+#endif
+
+private:
+    const String m_name;
+    malValueVec  m_fields;  // keywords, so a layout is acyclic
+    HAMT         m_slots;
 };
 
-class malBuiltIn : public malApplicable {
+typedef RefCountedPtr<RecordLayout> RecordLayoutPtr;
+
+//  A record holds its fields' values in a flat array, in the layout's
+//  order, so it costs a word per field. It is a map like any other, and
+//  keys which aren't fields are kept in a hash-map of extras alongside.
+
+class malRecord : public Counted<malRecord, malMap> {
+public:
+    malRecord(RecordLayoutPtr layout, malValueVec* slots, const HAMT& extras);
+    malRecord(const malRecord& that, malValuePtr meta)
+    : Counted(meta), m_layout(that.m_layout), m_slots(that.m_slots)
+    , m_extras(that.m_extras) { }
+
+    virtual int count() const {
+        return m_slots.size() + m_extras.count();
+    }
+    virtual const malValueRef* find(malValuePtr key) const;
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    // Removing a field leaves a hash-map, as the record's type no longer
+    // fits.
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool forEach(const Visitor& visit) const;
+
+    // Only for a record which nothing else refers to.
+    void assocInPlace(malValueIter argsBegin, malValueIter argsEnd);
+
+    const RecordLayoutPtr& layout() const { return m_layout; }
+
+    virtual String print(bool readably) const;
+
+    virtual void getChildren(RefCountedVec& children) const;
+#ifdef MAL_TRACING_GC
+    virtual const void* ownedBuffer() const { return m_slots.data(); }
+#endif
+
+    WITH_META(malRecord);
+
+private:
+    RecordLayoutPtr m_layout;
+    malValueRefVec  m_slots;
+    HAMT            m_extras;
+};
+
+//  The constructor of a record type, which makes a record from its
+//  arguments, one for each field in order.
+
+class malRecordType : public Counted<malRecordType, malApplicable> {
+public:
+    malRecordType(RecordLayoutPtr layout) : m_layout(layout) { }
+    malRecordType(const malRecordType& that, malValuePtr meta)
+    : Counted(meta), m_layout(that.m_layout) { }
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    // Makes a record from the entries of a map; fields which it lacks are
+    // nil.
+    malValuePtr fromMap(const malMap* map) const;
+
+    const RecordLayoutPtr& layout() const { return m_layout; }
+
+    virtual String print(bool readably) const {
+        return STRF("#record-type(%s)", m_layout->name().c_str());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return m_layout == static_cast<const malRecordType*>(rhs)->m_layout;
+    }
+    virtual uint32_t doHash() const;
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        children.push_back(m_layout.ptr());
+    }
+
+    WITH_META(malRecordType);
+
+private:
+    const RecordLayoutPtr m_layout;
+};
+
+class malSet : public malValue {
+public:
+    typedef std::function<bool (const malValuePtr& item)> Visitor;
+
+    malSet() { }
+    malSet(malValuePtr meta) : malValue(meta) { }
+
+    virtual int count() const = 0;
+    bool isEmpty() const { return count() == 0; }
+
+    virtual bool contains(malValuePtr item) const = 0;
+
+    virtual malValuePtr conj(malValueIter argsBegin,
+                             malValueIter argsEnd) const = 0;
+    virtual malValuePtr disj(malValueIter argsBegin,
+                             malValueIter argsEnd) const = 0;
+
+    // Calls visit on each item in turn, until it returns false.
+    virtual bool forEach(const Visitor& visit) const = 0;
+
+    malValuePtr seq() const;
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+    virtual uint32_t doHash() const;
+};
+
+class malHashSet : public Counted<malHashSet, malSet> {
+public:
+    malHashSet(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
+    malHashSet(const HAMT& items);
+    malHashSet(const malHashSet& that, malValuePtr meta)
+    : Counted(meta), m_items(that.m_items)
+    , m_isEvaluated(that.m_isEvaluated) { }
+
+    virtual int count() const { return m_items.count(); }
+    virtual bool contains(malValuePtr item) const {
+        return m_items.find(item) != NULL;
+    }
+    virtual malValuePtr conj(malValueIter argsBegin,
+                             malValueIter argsEnd) const;
+    virtual malValuePtr disj(malValueIter argsBegin,
+                             malValueIter argsEnd) const;
+    virtual bool forEach(const Visitor& visit) const;
+
+    malValuePtr eval(malEnvPtr env);
+
+    // Each item is held as both key and value.
+    const HAMT& entries() const { return m_items; }
+
+    // Only for a set which nothing else refers to.
+    void conjInPlace(malValueIter argsBegin, malValueIter argsEnd);
+    void disjInPlace(malValueIter argsBegin, malValueIter argsEnd);
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_items.getChildren(children);
+    }
+
+    WITH_META(malHashSet);
+
+private:
+    HAMT m_items;
+    bool m_isEvaluated;
+};
+
+class malSortedSet : public Counted<malSortedSet, malSet> {
+public:
+    malSortedSet(const AVLTree& items) : m_items(items) { }
+    malSortedSet(const malSortedSet& that, malValuePtr meta)
+    : Counted(meta), m_items(that.m_items) { }
+
+    virtual int count() const { return m_items.count(); }
+    virtual bool contains(malValuePtr item) const {
+        return m_items.find(item) != NULL;
+    }
+    virtual malValuePtr conj(malValueIter argsBegin,
+                             malValueIter argsEnd) const;
+    virtual malValuePtr disj(malValueIter argsBegin,
+                             malValueIter argsEnd) const;
+    virtual bool forEach(const Visitor& visit) const;
+
+    // Each item is held as both key and value.
+    const AVLTree& entries() const { return m_items; }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_items.getChildren(children);
+    }
+
+    WITH_META(malSortedSet);
+
+private:
+    const AVLTree m_items;
+};
+
+class malBuiltIn : public Counted<malBuiltIn, malApplicable> {
 public:
     typedef malValuePtr (ApplyFunc)(const String& name,
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
     malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    : m_name(name), m_handler(handler) { makeAcyclic(); }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : Counted(meta), m_name(that.m_name), m_handler(that.m_handler) { }
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
@@ -290,9 +750,11 @@ private:
     ApplyFunc* m_handler;
 };
 
-class malLambda : public malApplicable {
+class malLambda : public Counted<malLambda, malApplicable> {
 public:
-    malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    malLambda(StringVec& bindings, malValuePtr body, malEnvPtr env);
+    // The scope's outer scope must be env's.
+    malLambda(malScopePtr scope, malValuePtr body, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
@@ -314,18 +776,20 @@ public:
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    virtual void getChildren(RefCountedVec& children) const;
+
 private:
-    const StringVec   m_bindings;
+    const malScopePtr m_scope;
     const malValuePtr m_body;
     const malEnvPtr   m_env;
     const bool        m_isMacro;
 };
 
-class malAtom : public malValue {
+class malAtom : public Counted<malAtom, malValue> {
 public:
     malAtom(malValuePtr value) : m_value(value) { }
     malAtom(const malAtom& that, malValuePtr meta)
-        : malValue(meta), m_value(that.m_value) { }
+        : Counted(meta), m_value(that.m_value) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this->m_value->isEqualTo(rhs);
@@ -339,36 +803,171 @@ public:
 
     malValuePtr reset(malValuePtr value) { return m_value = value; }
 
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        children.push_back(m_value.ptr());
+    }
+
     WITH_META(malAtom);
 
 private:
     malValuePtr m_value;
 };
 
+// A total order over the values which can be sorted: nil, then booleans,
+// numbers, strings, keywords, symbols and sequences, which compare their
+// items in turn. Values of any other type are only comparable if equal.
+int compareValues(const malValuePtr& lhs, const malValuePtr& rhs);
+
+//  A transient is a mutable working copy of a vector, map or set, for
+//  building one up in a batch. It owns the nodes it copies, and updates them
+//  in place thereafter, until persistent! freezes it and hands them over.
+class malTransient : public malValue {
+public:
+    malTransient() : m_owner(newOwner()) { }
+
+    virtual int count() const = 0;
+
+    // Each of these updates the transient in place, and returns it.
+    virtual malValuePtr conj(malValueIter argsBegin,
+                             malValueIter argsEnd) = 0;
+    virtual malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd);
+    virtual malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd);
+    virtual malValuePtr disj(malValueIter argsBegin, malValueIter argsEnd);
+
+    malValuePtr persistent();
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs; // these are mutable
+    }
+
+    virtual malValuePtr doWithMeta(malValuePtr meta) const;
+
+protected:
+    // Fails once the transient has been made persistent.
+    malOwner owner() const;
+
+    virtual malValuePtr makePersistent() const = 0;
+
+private:
+    malOwner m_owner;
+};
+
+class malTransientVector : public Counted<malTransientVector, malTransient> {
+public:
+    malTransientVector(const RRBVector& items) : m_items(items) { }
+
+    virtual int count() const { return m_items.count(); }
+    virtual malValuePtr conj(malValueIter argsBegin, malValueIter argsEnd);
+
+    virtual String print(bool readably) const {
+        return STRF("#transient-vector(%p)", this);
+    }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_items.getChildren(children);
+    }
+
+protected:
+    virtual malValuePtr makePersistent() const;
+
+private:
+    RRBVector m_items;
+};
+
+class malTransientHash : public Counted<malTransientHash, malTransient> {
+public:
+    malTransientHash(const HAMT& map) : m_map(map) { }
+
+    virtual int count() const { return m_map.count(); }
+    virtual malValuePtr conj(malValueIter argsBegin, malValueIter argsEnd);
+    virtual malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd);
+    virtual malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd);
+
+    virtual String print(bool readably) const {
+        return STRF("#transient-map(%p)", this);
+    }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_map.getChildren(children);
+    }
+
+protected:
+    virtual malValuePtr makePersistent() const;
+
+private:
+    HAMT m_map;
+};
+
+class malTransientSet : public Counted<malTransientSet, malTransient> {
+public:
+    malTransientSet(const HAMT& items) : m_items(items) { }
+
+    virtual int count() const { return m_items.count(); }
+    virtual malValuePtr conj(malValueIter argsBegin, malValueIter argsEnd);
+    virtual malValuePtr disj(malValueIter argsBegin, malValueIter argsEnd);
+
+    virtual String print(bool readably) const {
+        return STRF("#transient-set(%p)", this);
+    }
+
+    virtual void getChildren(RefCountedVec& children) const {
+        malValue::getChildren(children);
+        m_items.getChildren(children);
+    }
+
+protected:
+    virtual malValuePtr makePersistent() const;
+
+private:
+    HAMT m_items;
+};
+
+//  nil, true and false. They're immortal, and made before main runs, so
+//  fetching one is just a load.
+extern malValue* const malNil;
+extern malValue* const malTrue;
+extern malValue* const malFalse;
+
 namespace mal {
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
     malValuePtr builtin(const String& name, malBuiltIn::ApplyFunc handler);
-    malValuePtr falseValue();
+    inline malValuePtr falseValue() { return malFalse; }
     malValuePtr hash(malValueIter argsBegin, malValueIter argsEnd,
                      bool isEvaluated);
-    malValuePtr hash(const malHash::Map& map);
+    malValuePtr hash(const HAMT& map);
     malValuePtr integer(int64_t value);
+    malValuePtr integer(const BigInteger& value);
     malValuePtr integer(const String& token);
+    malValuePtr intVector(malIntVec* items);
     malValuePtr keyword(const String& token);
-    malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(malScopePtr, malValuePtr, malEnvPtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
+    malValuePtr list(const RRBVector& items);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
-    malValuePtr nilValue();
+    inline malValuePtr nilValue() { return malNil; }
+    malValuePtr real(double value);
+    malValuePtr real(const String& token);
+    malValuePtr set(malValueIter argsBegin, malValueIter argsEnd,
+                    bool isEvaluated);
+    malValuePtr set(const HAMT& items);
+    malValuePtr sortedMap(const AVLTree& map);
+    malValuePtr sortedSet(const AVLTree& items);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
-    malValuePtr trueValue();
+    inline malValuePtr trueValue() { return malTrue; }
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
+    malValuePtr vector(const RRBVector& items);
+    malValuePtr vector(malValuePtr a, malValuePtr b);
 };
 
 #endif // INCLUDE_TYPES_H
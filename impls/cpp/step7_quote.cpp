@@ -209,7 +209,8 @@ static malValuePtr starts_with(const malValuePtr ast, const char* sym)
 
 static malValuePtr quasiquote(malValuePtr obj)
 {
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malMap, obj) ||
+        DYNAMIC_CAST(malSet, obj))
         return mal::list(mal::symbol("quote"), obj);
 
     const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
@@ -280,7 +280,8 @@ static malValuePtr starts_with(const malValuePtr ast, const char* sym)
 
 static malValuePtr quasiquote(malValuePtr obj)
 {
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malMap, obj) ||
+        DYNAMIC_CAST(malSet, obj))
         return mal::list(mal::symbol("quote"), obj);
 
     const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
@@ -325,7 +326,8 @@ static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
         const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+        malValueVec args(seq->begin() + 1, seq->end());
+        obj = macro->apply(args.begin(), args.end());
     }
     return obj;
 }
@@ -4,6 +4,7 @@
 #include "ReadLine.h"
 #include "Types.h"
 
+#include <cstdlib>
 #include <iostream>
 #include <memory>
 
@@ -16,6 +17,10 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
 static malValuePtr quasiquote(malValuePtr obj);
 static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static malScopePtr formScope(const malSymbol* symbol,
+                             const malSequence* names,
+                             int first, int count, int step,
+                             malEnvPtr env, bool isParameterList = false);
 
 static ReadLine s_readLine("~/.mal-history");
 
@@ -25,6 +30,11 @@ int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
+    // Every global lookup ends in the root environment.
+    replEnv->makeImmortal();
+    if (const char* budget = getenv("MAL_ALLOC_BUDGET")) {
+        RefCounted::setEvaluationBudget(strtoull(budget, NULL, 10));
+    }
     installCore(replEnv);
     installFunctions(replEnv);
     makeArgv(replEnv, argc - 2, argv + 2);
@@ -69,6 +79,7 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[])
 
 String rep(const String& input, malEnvPtr env)
 {
+    RefCounted::AllocationBudget budget(RefCounted::evaluationBudget());
     return PRINT(EVAL(READ(input), env));
 }
 
@@ -83,6 +94,13 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         env = replEnv;
     }
     while (1) {
+        // Everything this and its callers use is held by a counted pointer
+        // here, so it's a safe point at which to collect cycles.
+        if (RefCounted::isCollectionDue()) {
+            RefCounted::collectCycles();
+        }
+        RefCounted::drainReleases(RefCounted::releaseBudget());
+
         const malList* list = DYNAMIC_CAST(malList, ast);
         if (!list || (list->count() == 0)) {
             return ast->eval(env);
@@ -130,14 +148,10 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
-                }
+                malScopePtr scope = formScope(symbol, bindings, 0,
+                                              bindings->count(), 1, env, true);
 
-                return mal::lambda(params, list->item(2), env);
+                return mal::lambda(scope, list->item(2), env);
             }
 
             if (special == "if") {
@@ -156,11 +170,12 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 const malSequence* bindings =
                     VALUE_CAST(malSequence, list->item(1));
                 int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
+                malScopePtr scope = formScope(symbol, bindings, 0,
+                                              count / 2, 2, env);
+                malEnvPtr inner(new malEnv(env, scope));
                 for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                    inner->setSlot(scope->bindingSlot(i / 2),
+                                   EVAL(bindings->item(i+1), inner));
                 }
                 ast = list->item(2);
                 env = inner;
@@ -199,15 +214,16 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 const malList* catchBlock = VALUE_CAST(malList, list->item(2));
 
                 checkArgsIs("catch*", 2, catchBlock->count() - 1);
-                MAL_CHECK(VALUE_CAST(malSymbol,
-                    catchBlock->item(0))->value() == "catch*",
+                const malSymbol* catchSym =
+                    VALUE_CAST(malSymbol, catchBlock->item(0));
+                MAL_CHECK(catchSym->value() == "catch*",
                     "catch block must begin with catch*");
 
-                // We don't need excSym at this scope, but we want to check
-                // that the catch block is valid always, not just in case of
-                // an exception.
-                const malSymbol* excSym =
-                    VALUE_CAST(malSymbol, catchBlock->item(1));
+                // We don't need the catch block's scope yet, but making it
+                // checks that the block is valid always, not just in case
+                // of an exception.
+                malScopePtr catchScope =
+                    formScope(catchSym, catchBlock, 1, 1, 1, env);
 
                 malValuePtr excVal;
 
@@ -227,8 +243,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
 
                 if (excVal) {
                     // we got some exception
-                    env = malEnvPtr(new malEnv(env));
-                    env->set(excSym->value(), excVal);
+                    env = malEnvPtr(new malEnv(env, catchScope));
+                    env->setSlot(catchScope->bindingSlot(0), excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
@@ -281,7 +297,8 @@ static malValuePtr starts_with(const malValuePtr ast, const char* sym)
 
 static malValuePtr quasiquote(malValuePtr obj)
 {
-    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
+    if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malMap, obj) ||
+        DYNAMIC_CAST(malSet, obj))
         return mal::list(mal::symbol("quote"), obj);
 
     const malSequence* seq = DYNAMIC_CAST(malSequence, obj);
@@ -306,16 +323,45 @@ static malValuePtr quasiquote(malValuePtr obj)
     return res;
 }
 
+//  The scope of the form headed by symbol, binding count symbols of names,
+//  every step'th from first, in frames made in env: the one made for it
+//  last time, unless that no longer fits, as when a macro builds the form.
+static malScopePtr formScope(const malSymbol* symbol,
+                             const malSequence* names,
+                             int first, int count, int step,
+                             malEnvPtr env, bool isParameterList)
+{
+    malScopePtr scope = symbol->formScope();
+    bool fits = scope && scope->outer() == env->scope()
+                      && scope->bindingCount() == count;
+    for (int i = 0; fits && i < count; i++) {
+        const malSymbol* name =
+            DYNAMIC_CAST(malSymbol, names->item(first + i * step));
+        fits = name && name->value() == scope->binding(i);
+    }
+    if (fits) {
+        return scope;
+    }
+
+    StringVec bindings;
+    for (int i = 0; i < count; i++) {
+        const malSymbol* name =
+            VALUE_CAST(malSymbol, names->item(first + i * step));
+        bindings.push_back(name->value());
+    }
+    scope = new malScope(bindings, env->scope(), isParameterList);
+    symbol->setFormScope(scope);
+    return scope;
+}
+
 static const malLambda* isMacroApplication(malValuePtr obj, malEnvPtr env)
 {
     const malList* seq = DYNAMIC_CAST(malList, obj);
     if (seq && !seq->isEmpty()) {
         if (malSymbol* sym = DYNAMIC_CAST(malSymbol, seq->item(0))) {
-            if (malEnvPtr symEnv = env->find(sym->value())) {
-                malValuePtr value = sym->eval(symEnv);
-                if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
-                    return lambda->isMacro() ? lambda : NULL;
-                }
+            malValuePtr value = sym->lookup(env);
+            if (malLambda* lambda = DYNAMIC_CAST(malLambda, value)) {
+                return lambda->isMacro() ? lambda : NULL;
             }
         }
     }
@@ -326,7 +372,8 @@ static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
 {
     while (const malLambda* macro = isMacroApplication(obj, env)) {
         const malSequence* seq = STATIC_CAST(malSequence, obj);
-        obj = macro->apply(seq->begin() + 1, seq->end());
+        malValueVec args(seq->begin() + 1, seq->end());
+        obj = macro->apply(args.begin(), args.end());
     }
     return obj;
 }
@@ -336,6 +383,12 @@ static const char* malFunctionTable[] = {
     "(def! not (fn* (cond) (if cond false true)))",
     "(def! load-file (fn* (filename) \
         (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
+    "(defmacro! defrecord (fn* [name fields] \
+        `(do (def! ~(symbol (str \"->\" name)) \
+                   (record-type ~(str name) (quote ~fields))) \
+             (def! ~(symbol (str \"map->\" name)) \
+                   (fn* [m] (record ~(symbol (str \"->\" name)) m))) \
+             (quote ~name))))",
     "(def! *host-language* \"C++\")",
 };
 
@@ -343,6 +396,7 @@ static void installFunctions(malEnvPtr env) {
     for (auto &function : malFunctionTable) {
         rep(function, env);
     }
+    env->makeBindingsImmortal();
 }
 
 // Added to keep the linker happy at step A